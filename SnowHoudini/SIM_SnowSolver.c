@@ -1,15 +1,17 @@
 #include "SIM_SnowSolver.h"
-#include "Eigen/Dense"
 
 #include <GU/GU_DetailHandle.h>
 #include <GU/GU_Detail.h>
 #include <GA/GA_Handle.h>
 #include <GA/GA_AttributeRef.h>
 #include <GA/GA_Iterator.h>
+#include <GA/GA_PageIterator.h>
 #include <GA/GA_Types.h>
 #include <UT/UT_DSOVersion.h>
 #include <UT/UT_Interrupt.h>
 #include <UT/UT_Matrix3.h>
+#include <UT/UT_Vector4.h>
+#include <UT/UT_VoxelArray.h>
 #include <UT/UT_MatrixSolver.h>
 #include <PRM/PRM_Include.h>
 #include <SIM/SIM_PRMShared.h>
@@ -24,7 +26,6 @@
 #include <OP/OP_Node.h>
 #include <OP/OP_Context.h>
 #include <CH/CH_Manager.h>
-#include <boost/array.hpp>
 
 #include <iostream>
 #include <stdio.h>
@@ -32,10 +33,74 @@
 #include <vector>
 #include <ctime>
 
-typedef Eigen::Matrix<freal,3,3> eigen_matrix3;
-typedef Eigen::Matrix<freal,3,1> eigen_vector3;
+//Most substeps the CFL condition can split a DOP step into; only there so that a
+//runaway particle can't stall the cook
+static const int MAX_SUBSTEPS = 10000;
+
+//Copying between Houdini fields and SnowGrid; the voxel iterators go a tile at a time,
+//in memory order, which is much cheaper than getValue/setValue on each voxel. Voxels
+//outside the grid (if a field has a different resolution) are left alone. Each job
+//copies its own share of the tiles
+template<class Node, class T> void readField(UT_VoxelArrayF *field, const SnowGrid &grid, std::vector<Node> &nodes, T Node::*value, const UT_JobInfo &info){
+	UT_VoxelArrayIteratorF vit;
+	vit.setArray(field);
+	vit.setPartialRange(info.job(), info.numJobs());
+	for (vit.rewind(); !vit.atEnd(); vit.advance()){
+		if (grid.inside(vit.x(), vit.y(), vit.z()))
+			nodes[grid.index(vit.x(), vit.y(), vit.z())].*value = vit.getValue();
+	}
+}
+template<class Node> void readField(UT_VoxelArrayF *field, const SnowGrid &grid, std::vector<Node> &nodes, eigen_vector3 Node::*value, int axis, const UT_JobInfo &info){
+	UT_VoxelArrayIteratorF vit;
+	vit.setArray(field);
+	vit.setPartialRange(info.job(), info.numJobs());
+	for (vit.rewind(); !vit.atEnd(); vit.advance()){
+		if (grid.inside(vit.x(), vit.y(), vit.z()))
+			(nodes[grid.index(vit.x(), vit.y(), vit.z())].*value)[axis] = vit.getValue();
+	}
+}
+template<class T> void writeField(UT_VoxelArrayF *field, const SnowGrid &grid, T SnowNode::*value, const UT_JobInfo &info){
+	UT_VoxelArrayIteratorF vit;
+	vit.setArray(field);
+	vit.setPartialRange(info.job(), info.numJobs());
+	for (vit.rewind(); !vit.atEnd(); vit.advance()){
+		if (grid.inside(vit.x(), vit.y(), vit.z()))
+			vit.setValue(grid.nodes[grid.index(vit.x(), vit.y(), vit.z())].*value);
+	}
+}
+inline void writeField(UT_VoxelArrayF *field, const SnowGrid &grid, eigen_vector3 SnowNode::*value, int axis, const UT_JobInfo &info){
+	UT_VoxelArrayIteratorF vit;
+	vit.setArray(field);
+	vit.setPartialRange(info.job(), info.numJobs());
+	for (vit.rewind(); !vit.atEnd(); vit.advance()){
+		if (grid.inside(vit.x(), vit.y(), vit.z()))
+			vit.setValue((grid.nodes[grid.index(vit.x(), vit.y(), vit.z())].*value)[axis]);
+	}
+}
 
-inline bool computeSDFNormal(const UT_VoxelArrayF *g_col, int iX, int iY, int iZ, vector3 &norm);
+//Conversions between Houdini's and the core's vectors and matrices
+inline eigen_vector3 toCore(const vector3 &v){
+	return eigen_vector3(v[0], v[1], v[2]);
+}
+inline eigen_matrix3 toCore(const matrix3 &m){
+	eigen_matrix3 out;
+	for (int i=0; i<3; i++){
+		for (int j=0; j<3; j++)
+			out(i,j) = m(i,j);
+	}
+	return out;
+}
+inline vector3 toHoudini(const eigen_vector3 &v){
+	return vector3(v[0], v[1], v[2]);
+}
+inline matrix3 toHoudini(const eigen_matrix3 &m){
+	matrix3 out;
+	for (int i=0; i<3; i++){
+		for (int j=0; j<3; j++)
+			out(i,j) = m(i,j);
+	}
+	return out;
+}
 
 //Houdini hook
 void initializeSIM(void *){
@@ -43,7 +108,9 @@ void initializeSIM(void *){
 }
 
 //Constructor
-SIM_SnowSolver::SIM_SnowSolver(const SIM_DataFactory *factory) : BaseClass(factory){}
+SIM_SnowSolver::SIM_SnowSolver(const SIM_DataFactory *factory) : BaseClass(factory){
+	core.jobs = this;
+}
 SIM_SnowSolver::~SIM_SnowSolver(){}
 
 //Gets node description data
@@ -66,6 +133,8 @@ const SIM_DopDescription* SIM_SnowSolver::getDescription(){
 	//It may be better to remove these, if recomputing these values is actually faster than caching
 	static PRM_Name p_w(MPM_P_W, "Weights Attr");					//particle weight (for each node within 2-node radius)
 	static PRM_Name p_wg(MPM_P_WG, "Weight Gradients Attr");		//particle weight gradient (for each node within 2-node radius)
+	static PRM_Name p_svdq(MPM_P_SVDQ, "SVD Rotation Attr");		//particle SVD rotation, to warm start the next SVD (optional)
+	static PRM_Name p_jp(MPM_P_JP, "Jp Attr");					//particle plastic volume change, used instead of Fp Attr (optional)
 
 	//Grid parameters (eulerian):
 	static PRM_Name g_mass(MPM_G_MASS, "Mass Field");				//grid mass
@@ -103,6 +172,8 @@ const SIM_DopDescription* SIM_SnowSolver::getDescription(){
 		PRM_Template(PRM_STRING, 1, &p_d),
 		PRM_Template(PRM_STRING, 1, &p_w),
 		PRM_Template(PRM_STRING, 1, &p_wg),
+		PRM_Template(PRM_STRING, 1, &p_svdq),
+		PRM_Template(PRM_STRING, 1, &p_jp),
 		//grid
 		PRM_Template(PRM_STRING, 1, &g_mass),
 		PRM_Template(PRM_STRING, 1, &g_nvel),
@@ -143,36 +214,105 @@ const SIM_DopDescription* SIM_SnowSolver::getDescription(){
 	return &desc;
 }
 
+void SIM_SnowSolver::runJobsPartial(SnowCore* core, SnowTask task, int count, int chunk, const UT_JobInfo &info){
+	for (int c=info.nextTask(), begin=c*chunk; begin<count; c=info.nextTask(), begin=c*chunk){
+		int end = begin+chunk;
+		(core->*task)(begin, end > count ? count : end);
+	}
+}
+
+void SIM_SnowSolver::copyParticlesPartial(const GU_Detail* gdp, SnowAttributes* attributes, bool to_core, const UT_JobInfo &info){
+	SnowParticles &particles = core.particles;
+	GA_Offset start, end;
+	for (GA_PageIterator pit = gdp->getPointRange().beginPages(info); !pit.atEnd(); ++pit){
+		for (GA_Iterator it(pit.begin()); it.blockAdvance(start, end);){
+			for (GA_Offset offset=start; offset<end; offset++){
+				int pid = gdp->pointIndex(offset);
+				if (to_core){
+					particles.position[pid] = toCore(attributes->position.get(offset));
+					particles.velocity[pid] = toCore(attributes->velocity.get(offset));
+					particles.volume[pid] = attributes->volume.get(offset);
+					particles.density[pid] = attributes->density.get(offset);
+					particles.def_elastic[pid] = toCore(attributes->def_elastic.get(offset));
+					if (particles.scalar_jp)
+						particles.jp[pid] = attributes->jp.get(offset);
+					else particles.def_plastic[pid] = toCore(attributes->def_plastic.get(offset));
+					if (particles.warm_svd){
+						UT_Vector4T<freal> q = attributes->svd_rotation.get(offset);
+						particles.svd_rotation[pid] = eigen_vector4(q[0], q[1], q[2], q[3]);
+					}
+				}
+				else{
+					attributes->position.set(offset, toHoudini(particles.position[pid]));
+					attributes->velocity.set(offset, toHoudini(particles.velocity[pid]));
+					attributes->density.set(offset, particles.density[pid]);
+					attributes->def_elastic.set(offset, toHoudini(particles.def_elastic[pid]));
+					if (particles.scalar_jp)
+						attributes->jp.set(offset, particles.jp[pid]);
+					else attributes->def_plastic.set(offset, toHoudini(particles.def_plastic[pid]));
+					if (particles.warm_svd){
+						const eigen_vector4 &q = particles.svd_rotation[pid];
+						attributes->svd_rotation.set(offset, UT_Vector4T<freal>(q[0], q[1], q[2], q[3]));
+					}
+				}
+			}
+		}
+	}
+}
+
+void SIM_SnowSolver::copyFieldsPartial(const SnowFields* fields, bool to_core, const UT_JobInfo &info){
+	SnowGrid &grid = core.grid;
+	if (to_core){
+		readField(fields->mass, grid, grid.nodes, &SnowNode::mass, info);
+		readField(fields->active, grid, grid.nodes, &SnowNode::active, info);
+		readField(fields->col, grid, grid.inputs, &SnowNodeInput::col_sdf, info);
+		for (int i=0; i<3; i++){
+			readField(fields->ovel[i], grid, grid.nodes, &SnowNode::velocity, i, info);
+			readField(fields->nvel[i], grid, grid.nodes, &SnowNode::velocity_new, i, info);
+			readField(fields->col_vel[i], grid, grid.inputs, &SnowNodeInput::col_velocity, i, info);
+			readField(fields->ext_force[i], grid, grid.inputs, &SnowNodeInput::ext_force, i, info);
+		}
+	}
+	else{
+		writeField(fields->mass, grid, &SnowNode::mass, info);
+		writeField(fields->active, grid, &SnowNode::active, info);
+		for (int i=0; i<3; i++){
+			writeField(fields->ovel[i], grid, &SnowNode::velocity, i, info);
+			writeField(fields->nvel[i], grid, &SnowNode::velocity_new, i, info);
+		}
+	}
+}
+
 //Do the interpolation calculations
 bool SIM_SnowSolver::solveGasSubclass(SIM_Engine &engine, SIM_Object *obj, SIM_Time time, SIM_Time framerate){
 
 	/// STEP #0: Retrieve all data objects from Houdini
 
 	//Scalar params
-	freal particle_mass = getPMass();
-	freal YOUNGS_MODULUS = getYoungsModulus();
-	freal POISSONS_RATIO = getPoissonsRatio();
-	freal CRIT_COMPRESS = getCritComp();
-	freal CRIT_STRETCH = getCritStretch();
-	freal FLIP_PERCENT = getFlipPercent();
-	freal HARDENING = getHardening();
-	freal CFL = getCfl();
-	freal COF = getCof();
-	freal division_size = getDivSize();
-	freal max_vel = getMaxVel();
+	SnowParameters &params = core.params;
+	params.particle_mass = getPMass();
+	params.youngs_modulus = getYoungsModulus();
+	params.poissons_ratio = getPoissonsRatio();
+	params.crit_compress = getCritComp();
+	params.crit_stretch = getCritStretch();
+	params.flip_percent = getFlipPercent();
+	params.hardening = getHardening();
+	params.cfl = getCfl();
+	params.cof = getCof();
+	params.max_velocity = getMaxVel();
 	//Vector params
-	vector3 GRAVITY = getGravity();
-	vector3 bbox_min_limit = getBboxMin();
-	vector3 bbox_max_limit = getBboxMax();
+	params.gravity = toCore(getGravity());
 
 	//Particle params
-	UT_String s_p, s_vol, s_den, s_vel, s_fe, s_fp;
+	UT_String s_p, s_vol, s_den, s_vel, s_fe, s_fp, s_svdq, s_jp;
 	getParticles(s_p);
 	getPVol(s_vol);
 	getPD(s_den);
 	getPVel(s_vel);
 	getPFe(s_fe);
 	getPFp(s_fp);
+	getPSvdq(s_svdq);
+	getPJp(s_jp);
 
 	SIM_Geometry* geometry = (SIM_Geometry*) obj->getNamedSubData(s_p);
 	if (!geometry) return true;
@@ -202,9 +342,21 @@ bool SIM_SnowSolver::solveGasSubclass(SIM_Engine &engine, SIM_Object *obj, SIM_T
 	GA_RWAttributeRef p_ref_Fp = gdp_out->findPointAttribute(s_fp);
 	GA_RWHandleT<matrix3> p_Fp(p_ref_Fp.getAttribute());
 
-	//EVALUATE PARAMETERS
-	freal mu = YOUNGS_MODULUS/(2+2*POISSONS_RATIO);
-	freal lambda = YOUNGS_MODULUS*POISSONS_RATIO/((1+POISSONS_RATIO)*(1-2*POISSONS_RATIO));
+	//Last SVD's rotation, as a quaternion; if there's no such attribute, every SVD starts from scratch
+	GA_RWAttributeRef p_ref_svdq = gdp_out->findPointAttribute(s_svdq);
+	GA_RWHandleT<UT_Vector4T<freal> > p_svdq(p_ref_svdq.getAttribute());
+
+	//Determinant of the plastic deformation gradient; if there's such an attribute, it's
+	//all we keep of the plastic gradient (which is all the solver needs), and the Fp
+	//attribute is left alone
+	GA_RWAttributeRef p_ref_jp = gdp_out->findPointAttribute(s_jp);
+	GA_RWHandleT<freal> p_jp(p_ref_jp.getAttribute());
+
+	if (!p_position.isValid()){
+		gdh.unlock(gdp_out);
+		gdh.unlock(gdp_in);
+		return true;
+	}
 
 	//Get grid data
 	SIM_ScalarField *g_mass_field;
@@ -227,11 +379,6 @@ bool SIM_SnowSolver::solveGasSubclass(SIM_Engine &engine, SIM_Object *obj, SIM_T
 	getMatchingData(g_active_data, obj, MPM_G_ACTIVE);	
 	g_active_field = SIM_DATA_CAST(g_active_data(0), SIM_ScalarField);
 
-	SIM_ScalarField *g_density_field;
-	SIM_DataArray g_density_data;
-	getMatchingData(g_density_data, obj, MPM_G_DENSITY);	
-	g_density_field = SIM_DATA_CAST(g_density_data(0), SIM_ScalarField);
-
 	SIM_ScalarField *g_col_field;
 	SIM_DataArray g_col_data;
 	getMatchingData(g_col_data, obj, MPM_G_COL);	
@@ -249,509 +396,84 @@ bool SIM_SnowSolver::solveGasSubclass(SIM_Engine &engine, SIM_Object *obj, SIM_T
 	
 	UT_VoxelArrayF
 		*g_mass = g_mass_field->getField()->fieldNC(),
-		*g_nvelX = g_nvel_field->getField(0)->fieldNC(),
-		*g_nvelY = g_nvel_field->getField(1)->fieldNC(),
-		*g_nvelZ = g_nvel_field->getField(2)->fieldNC(),
-		*g_ovelX = g_ovel_field->getField(0)->fieldNC(),
-		*g_ovelY = g_ovel_field->getField(1)->fieldNC(),
-		*g_ovelZ = g_ovel_field->getField(2)->fieldNC(),
-		*g_colVelX = g_colVel_field->getField(0)->fieldNC(),
-		*g_colVelY = g_colVel_field->getField(1)->fieldNC(),
-		*g_colVelZ = g_colVel_field->getField(2)->fieldNC(),
-		*g_extForceX = g_extForce_field->getField(0)->fieldNC(),
-		*g_extForceY = g_extForce_field->getField(1)->fieldNC(),
-		*g_extForceZ = g_extForce_field->getField(2)->fieldNC(),
 		*g_col = g_col_field->getField()->fieldNC(),
-		*g_active = g_active_field->getField()->fieldNC();
-
-	int point_count = gdp_out->getPointRange().getEntries();
-	std::vector<boost::array<freal,64> > p_w(point_count);
-	std::vector<boost::array<vector3,64> > p_wgh(point_count);
+		*g_active = g_active_field->getField()->fieldNC(),
+		*g_ovel[3], *g_nvel[3], *g_colVel[3], *g_extForce[3];
+	for (int i=0; i<3; i++){
+		g_ovel[i] = g_ovel_field->getField(i)->fieldNC();
+		g_nvel[i] = g_nvel_field->getField(i)->fieldNC();
+		g_colVel[i] = g_colVel_field->getField(i)->fieldNC();
+		g_extForce[i] = g_extForce_field->getField(i)->fieldNC();
+	}
 
-	//Get world-to-grid conversion ratios
+	//Copy the particles into the core, in point order
+	SnowAttributes attributes;
+	attributes.position = p_position;
+	attributes.velocity = p_vel;
+	attributes.volume = p_volume;
+	attributes.density = p_density;
+	attributes.def_elastic = p_Fe;
+	attributes.def_plastic = p_Fp;
+	attributes.svd_rotation = p_svdq;
+	attributes.jp = p_jp;
+	SnowParticles &particles = core.particles;
+	particles.warm_svd = p_svdq.isValid();
+	particles.scalar_jp = p_jp.isValid();
+	particles.resize(gdp_in->getNumPoints());
+	copyParticles(gdp_in, &attributes, true);
+
+	//Copy the fields into the core's grid
 	//Particle's grid position can be found via (pos - grid_origin)/voxel_dims
-	vector3
-		voxel_dims = g_mass_field->getVoxelSize(),
-		grid_origin = g_mass_field->getOrig(),
-		grid_divs = g_mass_field->getDivisions();
+	SnowGrid &grid = core.grid;
+	vector3 grid_divs = g_mass_field->getDivisions();
+	int divisions[3] = {(int) grid_divs[0], (int) grid_divs[1], (int) grid_divs[2]};
+	core.resetGrid(divisions);
+	grid.cellsize = toCore(g_mass_field->getVoxelSize());
 	//Houdini uses voxel centers for grid nodes, rather than grid corners
-	grid_origin += voxel_dims/2.0;
-	freal voxelArea = voxel_dims[0]*voxel_dims[1]*voxel_dims[2];
-	
-	/*
-	//Reset grid
-	for(int iX=0; iX < grid_divs[0]; iX++){
-		for(int iY=0; iY < grid_divs[1]; iY++){
-			for(int iZ=0; iZ < grid_divs[2]; iZ++){
-				g_mass->setValue(iX,iY,iZ,0);
-				g_active->setValue(iX,iY,iZ,0);
-				g_ovelX->setValue(iX,iY,iZ,0);
-				g_ovelY->setValue(iX,iY,iZ,0);
-				g_ovelZ->setValue(iX,iY,iZ,0);
-				g_nvelX->setValue(iX,iY,iZ,0);
-				g_nvelY->setValue(iX,iY,iZ,0);
-				g_nvelZ->setValue(iX,iY,iZ,0);
-			}
-		}
-	}
-	*/
-
-	/// STEP #1: Transfer mass to grid
-
-	if (p_position.isValid()){
-
-		//Iterate through particles
-		for (GA_Iterator it(gdp_out->getPointRange()); !it.atEnd(); it.advance()){
-			int pid = it.getOffset();
-							
-			//Get grid position
-			vector3 gpos = (p_position.get(pid) - grid_origin)/voxel_dims;
-			int p_gridx = (int) gpos[0], p_gridy = (int) gpos[1], p_gridz = (int) gpos[2];
-			//g_mass_field->posToIndex(p_position.get(pid),p_gridx,p_gridy,p_gridz);
-			freal particle_density = p_density.get(pid);
-			//Compute weights and transfer mass
-			for (int idx=0, z=p_gridz-1, z_end=z+3; z<=z_end; z++){
-				//Z-dimension interpolation
-				freal z_pos = gpos[2]-z,
-					wz = SIM_SnowSolver::bspline(z_pos),
-					dz = SIM_SnowSolver::bsplineSlope(z_pos);
-				for (int y=p_gridy-1, y_end=y+3; y<=y_end; y++){
-					//Y-dimension interpolation
-					freal y_pos = gpos[1]-y,
-						wy = SIM_SnowSolver::bspline(y_pos),
-						dy = SIM_SnowSolver::bsplineSlope(y_pos);
-					for (int x=p_gridx-1, x_end=x+3; x<=x_end; x++, idx++){
-						//X-dimension interpolation
-						freal x_pos = gpos[0]-x,
-							wx = SIM_SnowSolver::bspline(x_pos),
-							dx = SIM_SnowSolver::bsplineSlope(x_pos);
-						
-						//Final weight is dyadic product of weights in each dimension
-						freal weight = wx*wy*wz;
-						p_w[pid-1][idx] = weight;
-
-						//Weight gradient is a vector of partial derivatives
-						p_wgh[pid-1][idx] = vector3(dx*wy*wz, wx*dy*wz, wx*wy*dz)/voxel_dims;
-
-						//Interpolate mass
-						freal node_mass = g_mass->getValue(x,y,z);
-						node_mass += weight*particle_mass;
-						g_mass->setValue(x,y,z,node_mass);
-					}
-				}
-			}
-		}
-	}
-	
-	/// STEP #2: First timestep only - Estimate particle volumes using grid mass
-
-	/*
-	if (time == 0.0){
-		//Iterate through particles
-		for (GA_Iterator it(gdp_out->getPointRange()); !it.atEnd(); it.advance()){
-			int pid = it.getOffset();
-			freal density = 0;
-
-			//Get grid position
-			int p_gridx = 0, p_gridy = 0, p_gridz = 0;
-			vector3 gpos = (p_position.get(pid) - grid_origin)/voxel_dims;
-			int p_gridx = (int) gpos[0], p_gridy = (int) gpos[1], p_gridz = (int) gpos[2];
-			//g_nvel_field->posToIndex(0,p_position.get(pid),p_gridx,p_gridy,p_gridz);
-			//Transfer grid density (within radius) to particles
-			for (int idx=0, z=p_gridz-1, z_end=z+3; z<=z_end; z++){
-				for (int y=p_gridy-1, y_end=y+3; y<=y_end; y++){
-					for (int x=p_gridx-1, x_end=x+3; x<=x_end; x++, idx++){
-						freal w = p_w[pid-1][idx];
-						if (w > EPSILON){
-							//Transfer density
-							density += w * g_mass->getValue(x,y,z);
-						}
-					}
-				}
-			}
-			
-			density /= voxelArea;
-			p_density.set(pid,density);
-			p_volume.set(pid, particle_mass/density);
-		}
-	}
-	//*/
-	
-	/// STEP #3: Transfer velocity to grid
-
-	//This must happen after transferring mass, to conserve momentum
-	//Iterate through particles and transfer
-	for (GA_Iterator it(gdp_in->getPointRange()); !it.atEnd(); it.advance()){
-		int pid = it.getOffset();
-		vector3 vel_fac = p_vel.get(pid)*particle_mass;
-
-		//Get grid position
-		vector3 gpos = (p_position.get(pid) - grid_origin)/voxel_dims;
-		int p_gridx = (int) gpos[0], p_gridy = (int) gpos[1], p_gridz = (int) gpos[2];
-		//g_nvel_field->posToIndex(0,p_position.get(pid),p_gridx,p_gridy,p_gridz);
-
-		//Transfer to grid nodes within radius
-		for (int idx=0, z=p_gridz-1, z_end=z+3; z<=z_end; z++){
-			for (int y=p_gridy-1, y_end=y+3; y<=y_end; y++){
-				for (int x=p_gridx-1, x_end=x+3; x<=x_end; x++, idx++){
-					freal w = p_w[pid-1][idx];
-					if (w > EPSILON){
-						freal nodex_vel = g_ovelX->getValue(x,y,z) + vel_fac[0]*w;
-						freal nodey_vel = g_ovelY->getValue(x,y,z) + vel_fac[1]*w;
-						freal nodez_vel = g_ovelZ->getValue(x,y,z) + vel_fac[2]*w;
-						g_ovelX->setValue(x,y,z,nodex_vel);
-						g_ovelY->setValue(x,y,z,nodey_vel);
-						g_ovelZ->setValue(x,y,z,nodez_vel);			
-						g_active->setValue(x,y,z,1.0);			
-					}
-				}
-			}
-		}
+	grid.origin = toCore(g_mass_field->getOrig()) + grid.cellsize/2.0;
+	SnowFields fields;
+	fields.mass = g_mass;
+	fields.active = g_active;
+	fields.col = g_col;
+	for (int i=0; i<3; i++){
+		fields.ovel[i] = g_ovel[i];
+		fields.nvel[i] = g_nvel[i];
+		fields.col_vel[i] = g_colVel[i];
+		fields.ext_force[i] = g_extForce[i];
 	}
-	//Division is slow (maybe?); we only want to do divide by mass once, for each active node
-	for(int iX=0; iX < grid_divs[0]; iX++){
-		for(int iY=0; iY < grid_divs[1]; iY++){
-			for(int iZ=0; iZ < grid_divs[2]; iZ++){
-				//Only check nodes that have mass
-				if (g_active->getValue(iX,iY,iZ)){
-					freal node_mass = 1/(g_mass->getValue(iX,iY,iZ));
-					g_ovelX->setValue(iX,iY,iZ,(g_ovelX->getValue(iX,iY,iZ)*node_mass));
-					g_ovelY->setValue(iX,iY,iZ,(g_ovelY->getValue(iX,iY,iZ)*node_mass));
-					g_ovelZ->setValue(iX,iY,iZ,(g_ovelZ->getValue(iX,iY,iZ)*node_mass));
-				}
-			}
-		}
+	copyFields(&fields, true);
+
+	/// STEPS #1 to #7 (see SnowCore.h)
+	//Particle volumes come from the asset, so step #2 (core.estimateVolumes) is skipped
+	//The DOP step is split into as many equal substeps as the CFL condition needs, so
+	//calm frames take one and fast ones stay stable; with no CFL set, it takes one
+	freal timestep = framerate, stable = core.stableTimestep();
+	int substeps = 1;
+	if (stable > 0 && stable < timestep)
+		substeps = timestep/stable >= MAX_SUBSTEPS ? MAX_SUBSTEPS : (int) ceil(timestep/stable);
+	for (int i=0; i<substeps; i++){
+		//The first substep starts from the fields; the others start from a clear grid
+		if (i)
+			core.resetGrid(divisions);
+		core.step(timestep/substeps);
 	}
-	
-	/// STEP #4: Compute new grid velocities
-
-	//Temporary variables for plasticity and force calculation
-	//We need one set of variables for each thread that will be running
-	eigen_matrix3 def_elastic, def_plastic, energy, svd_u, svd_v;
-	Eigen::JacobiSVD<eigen_matrix3, Eigen::NoQRPreconditioner> svd;
-	eigen_vector3 svd_e;
-	matrix3  HDK_def_plastic, HDK_def_elastic, HDK_energy;
-	freal* data_dp = HDK_def_plastic.data();
-	freal* data_de = HDK_def_elastic.data();
-	freal* data_energy = HDK_energy.data();
-	//Map Eigen matrices to HDK matrices
-	Eigen::Map<eigen_matrix3> data_dp_map(data_dp);
-	Eigen::Map<eigen_matrix3> data_de_map(data_de);
-	Eigen::Map<eigen_matrix3> data_energy_map(data_energy);	
-
-	//Compute force at each particle and transfer to Eulerian grid
-	//We use "nvel" to hold the grid force, since that variable is not in use
-	for (GA_Iterator it(gdp_in->getPointRange()); !it.atEnd(); it.advance()){
-		int pid = it.getOffset();
-		
-		//Apply plasticity to deformation gradient, before computing forces
-		//We need to use the Eigen lib to do the SVD; transfer houdini matrices to Eigen matrices
-		HDK_def_plastic = p_Fp.get(pid);
-		HDK_def_elastic = p_Fe.get(pid);
-		def_plastic = Eigen::Map<eigen_matrix3>(data_dp);
-		def_elastic = Eigen::Map<eigen_matrix3>(data_de);
-		
-		//Compute singular value decomposition (uev*)
-		svd.compute(def_elastic, Eigen::ComputeFullV | Eigen::ComputeFullU);
-		svd_e = svd.singularValues();
-		svd_u = svd.matrixU();
-		svd_v = svd.matrixV();
-		//Clamp singular values
-		for (int i=0; i<3; i++){
-			if (svd_e[i] < CRIT_COMPRESS) 
-				svd_e[i] = CRIT_COMPRESS;
-			else if (svd_e[i] > CRIT_STRETCH)
-				svd_e[i] = CRIT_STRETCH;
-		}
-		//Put SVD back together for new elastic and plastic gradients
-		def_plastic = svd_v * svd_e.asDiagonal().inverse() * svd_u.transpose() * def_elastic * def_plastic;
-		svd_v.transposeInPlace();
-		def_elastic = svd_u * svd_e.asDiagonal() * svd_v;
-		
-		//Now compute the energy partial derivative (which we use to get force at each grid node)
-		energy = 2*mu*(def_elastic - svd_u*svd_v)*def_elastic.transpose();
-		//Je is the determinant of def_elastic (equivalent to svd_e.prod())
-		freal Je = svd_e.prod(),
-			contour = lambda*Je*(Je-1),
-			jp = def_plastic.determinant(),
-			particle_vol = p_volume.get(pid);
-		for (int i=0; i<3; i++)
-			energy(i,i) += contour;
-		energy *=  particle_vol * exp(HARDENING*(1-jp));
-		
-		//Transfer Eigen matrices back to HDK
-		data_dp_map = def_plastic;
-		data_de_map = def_elastic;
-		data_energy_map = energy;
-		
-		p_Fp.set(pid,HDK_def_plastic);
-		p_Fe.set(pid,HDK_def_elastic);
-		
-		//Transfer energy to surrounding grid nodes
-		vector3 gpos = (p_position.get(pid) - grid_origin)/voxel_dims;
-		int p_gridx = (int) gpos[0], p_gridy = (int) gpos[1], p_gridz = (int) gpos[2];
-		for (int idx=0, z=p_gridz-1, z_end=z+3; z<=z_end; z++){
-			for (int y=p_gridy-1, y_end=y+3; y<=y_end; y++){
-				for (int x=p_gridx-1, x_end=x+3; x<=x_end; x++, idx++){
-					freal w = p_w[pid-1][idx];
-					if (w > EPSILON){
-						vector3 ngrad = p_wgh[pid-1][idx];
-						g_nvelX->setValue(x,y,z,g_nvelX->getValue(x,y,z) + ngrad.dot(HDK_energy[0]));
-						g_nvelY->setValue(x,y,z,g_nvelY->getValue(x,y,z) + ngrad.dot(HDK_energy[1]));
-						g_nvelZ->setValue(x,y,z,g_nvelZ->getValue(x,y,z) + ngrad.dot(HDK_energy[2]));						
-					}
-				}
-			}
-		}
-	}
-
-	//Use new forces to solve for new velocities
-	for(int iX=0; iX < grid_divs[0]; iX++){
-		for(int iY=0; iY < grid_divs[1]; iY++){
-			for(int iZ=0; iZ < grid_divs[2]; iZ++){
-				//Only compute for active nodes
-				if (g_active->getValue(iX,iY,iZ)){
-					freal nodex_ovel = g_ovelX->getValue(iX,iY,iZ);
-					freal nodey_ovel = g_ovelY->getValue(iX,iY,iZ);
-					freal nodez_ovel = g_ovelZ->getValue(iX,iY,iZ);
-					freal forcex = g_nvelX->getValue(iX,iY,iZ);
-					freal forcey = g_nvelY->getValue(iX,iY,iZ);
-					freal forcez = g_nvelZ->getValue(iX,iY,iZ);
-					freal node_mass = 1/(g_mass->getValue(iX,iY,iZ));
-					freal ext_forceX = GRAVITY[0] + g_extForceX->getValue(iX,iY,iZ);
-					freal ext_forceY = GRAVITY[1] + g_extForceY->getValue(iX,iY,iZ);
-					freal ext_forceZ = GRAVITY[2] + g_extForceZ->getValue(iX,iY,iZ);
-					nodex_ovel += framerate*(ext_forceX - forcex*node_mass);
-					nodey_ovel += framerate*(ext_forceY - forcey*node_mass);
-					nodez_ovel += framerate*(ext_forceZ - forcez*node_mass);
-					
-					//Limit velocity to max_vel
-					vector3 g_nvel(nodex_ovel, nodey_ovel, nodez_ovel);
-					freal nvelNorm = g_nvel.length();
-					if(nvelNorm > max_vel){
-						freal velRatio = max_vel/nvelNorm;
-						g_nvel*= velRatio;
-					}
 
-					g_nvelX->setValue(iX,iY,iZ,g_nvel[0]);
-					g_nvelY->setValue(iX,iY,iZ,g_nvel[1]);
-					g_nvelZ->setValue(iX,iY,iZ,g_nvel[2]);
-
-				}
-			}
-		}
-	}
-
-	/// STEP #5: Grid collision resolution
-
-	vector3 sdf_normal;
-	//*
-	for(int iX=1; iX < grid_divs[0]-1; iX++){
-		for(int iY=1; iY < grid_divs[1]-1; iY++){
-			for(int iZ=1; iZ < grid_divs[2]-1; iZ++){
-				if (g_active->getValue(iX,iY,iZ)){
-					if (!computeSDFNormal(g_col, iX, iY, iZ, sdf_normal))
-						continue;
-
-					//Collider velocity
-					vector3 vco(
-						g_colVelX->getValue(iX,iY,iZ),
-						g_colVelY->getValue(iX,iY,iZ),
-						g_colVelZ->getValue(iX,iY,iZ)
-					);
-					//Grid velocity
-					vector3 v(
-						g_nvelX->getValue(iX,iY,iZ),
-						g_nvelY->getValue(iX,iY,iZ),
-						g_nvelZ->getValue(iX,iY,iZ)
-					);
-					//Skip if bodies are separating
-					vector3 vrel = v - vco;
-					
-					freal vn = vrel.dot(sdf_normal);
-					if (vn >= 0) continue;
-					//Resolve collisions; also add velocity of collision object to snow velocity
-					//Sticks to surface (too slow to overcome static friction)
-					vector3 vt = vrel - (sdf_normal*vn);
-
-					freal stick = vn*COF, vt_norm = vt.length();
-					if (vt_norm <= -stick)
-						vt = vco;
-					//Dynamic friction
-					else vt += stick*vt/vt_norm + vco;
-					
-					g_nvelX->setValue(iX,iY,iZ,vt[0]);	
-					g_nvelY->setValue(iX,iY,iZ,vt[1]);
-					g_nvelZ->setValue(iX,iY,iZ,vt[2]);
-				}
-			}
-		}
-	}
-	//*/
-
-	/// STEP #6: Transfer grid velocities to particles and integrate
-	/// STEP #7: Particle collision resolution
-
-	vector3 pic, flip, col_vel;
-	matrix3 vel_grad;
-	//Iterate through particles
-	for (GA_Iterator it(gdp_in->getPointRange()); !it.atEnd(); it.advance()){
-		int pid = it.getOffset();
-		//Particle position
-		vector3 pos(p_position.get(pid));
-		
-		//Reset velocity
-		pic[0] = 0.0;
-		pic[1] = 0.0;
-		pic[2] = 0.0;
-		flip = p_vel.get(pid);
-		vel_grad.zero();
-		freal density = 0;
-
-		 //Get grid position
-		vector3 gpos = (pos - grid_origin)/voxel_dims;
-		int p_gridx = (int) gpos[0], p_gridy = (int) gpos[1], p_gridz = (int) gpos[2];
-		for (int idx=0, z=p_gridz-1, z_end=z+3; z<=z_end; z++){
-			for (int y=p_gridy-1, y_end=y+3; y<=y_end; y++){
-				for (int x=p_gridx-1, x_end=x+3; x<=x_end; x++, idx++){
-					freal w = p_w[pid-1][idx];
-					if (w > EPSILON){
-						const vector3 node_wg = p_wgh[pid-1][idx];
-						const vector3 node_nvel(
-							g_nvelX->getValue(x,y,z),
-							g_nvelY->getValue(x,y,z),
-							g_nvelZ->getValue(x,y,z)
-						);
-
-						//Transfer velocities
-						pic += node_nvel*w;	
-						flip[0] += (node_nvel[0] - g_ovelX->getValue(x,y,z))*w;	
-						flip[1] += (node_nvel[1]- g_ovelY->getValue(x,y,z))*w;	
-						flip[2] += (node_nvel[2] - g_ovelZ->getValue(x,y,z))*w;
-						//Transfer density
-						density += w * g_mass->getValue(x,y,z);
-						//Transfer veloctiy gradient
-						vel_grad.outerproductUpdate(1.0, node_nvel, node_wg);
-					}
-				}
-			}
-		}
-
-		//Finalize velocity update
-		vector3 vel = flip*FLIP_PERCENT + pic*(1-FLIP_PERCENT);
-		
-		//Reset collision data
-		freal col_sdf = 0;
-		sdf_normal[0] = 0;
-		sdf_normal[1] = 0;
-		sdf_normal[2] = 0;
-		col_vel[0] = 0;
-		col_vel[1] = 0;
-		col_vel[2] = 0;
-		
-		//Interpolate surrounding nodes' SDF info to the particle (trilinear interpolation)
-
-		for (int idx=0, z=p_gridz, z_end=z+1; z<=z_end; z++){
-			freal w_z = gpos[2]-z;
-			for (int y=p_gridy, y_end=y+1; y<=y_end; y++){
-				freal w_zy = w_z*(gpos[1]-y);
-				for (int x=p_gridx, x_end=x+1; x<=x_end; x++, idx++){
-					freal weight = fabs(w_zy*(gpos[0]-x));
-					//cout << w_zy << "," << (gpos[0]-x) << "," << weight << endl;
-					vector3 temp_normal;
-					computeSDFNormal(g_col, x, y, z, temp_normal);
-						//goto SKIP_PCOLLIDE;
-					//cout << g_col->getValue(x, y, z) << endl;
-					//Interpolate
-					sdf_normal += temp_normal*weight;
-					col_sdf += g_col->getValue(x, y, z)*weight;
-					col_vel[0] += g_colVelX->getValue(x, y, z)*weight;
-					col_vel[1] += g_colVelY->getValue(x, y, z)*weight;
-					col_vel[2] += g_colVelZ->getValue(x, y, z)*weight;
-				}
-			}
-		}
-
-		//Resolve particle collisions	
-		//cout << col_sdf << endl;
-		if (col_sdf > 0){
-			vector3 vrel = vel - col_vel;
-			freal vn = vrel.dot(sdf_normal);
-			
-			//Skip if bodies are separating
-			if (vn < 0){
-				
-				//Resolve and add velocity of collision object to snow velocity
-				//Sticks to surface (too slow to overcome static friction)
-				vel = vrel - (sdf_normal*vn);
-				freal stick = vn*COF, vel_norm = vel.length();
-				if (vel_norm <= -stick)
-					vel = col_vel;
-				//Dynamic friction
-				else vel += stick*vel/vel_norm + col_vel;
-			}
-		}
-		
-		SKIP_PCOLLIDE:
-
-		//Finalize density update
-		density /= voxelArea;
-		p_density.set(pid,density);
-
-		//Update particle position
-		pos += framerate*vel;
-		//Limit particle position
-		int mask = 0;
-		/*		
-		for (int i=0; i<3; i++){
-			if (pos[i] > bbox_max_limit[i]){
-				pos[i] = bbox_max_limit[i];
-				vel[i] = 0.0;
-				mask |= 1 << i;
-			}
-			else if (pos[i] < bbox_min_limit[i]){
-				pos[i] = bbox_min_limit[i];
-				vel[i] = 0.0;
-				mask |= 1 << i;
-			}
-		}
-		//Slow particle down at bounds (not really necessary...)
-		if (mask){
-			for (int i=0; i<3; i++){
-				if (mask & 0x1)
-					vel[i] *= .05;
-				mask >>= 1;
-			}
-		}//*/
-		p_vel.set(pid,vel);
-		p_position.set(pid,pos);
-
-		//Update particle deformation gradient
-		//Note: plasticity is computed on the next timestep...
-		vel_grad *= framerate;
-		vel_grad(0,0) += 1;
-		vel_grad(1,1) += 1;
-		vel_grad(2,2) += 1;
-		
-		p_Fe.set(pid, vel_grad*p_Fe.get(pid));
-	}
+	//Copy the results back; pages shared between points (constant pages) are split up
+	//first, so the jobs never write to the same page
+	p_position.getAttribute()->hardenAllPages();
+	p_vel.getAttribute()->hardenAllPages();
+	p_density.getAttribute()->hardenAllPages();
+	p_Fe.getAttribute()->hardenAllPages();
+	if (particles.scalar_jp)
+		p_jp.getAttribute()->hardenAllPages();
+	else p_Fp.getAttribute()->hardenAllPages();
+	if (particles.warm_svd)
+		p_svdq.getAttribute()->hardenAllPages();
+	copyParticles(gdp_in, &attributes, false);
+	copyFields(&fields, false);
 
 	gdh.unlock(gdp_out);
     gdh.unlock(gdp_in);
 	
 	return true;
 }
-
-inline bool computeSDFNormal(const UT_VoxelArrayF *g_col, int iX, int iY, int iZ, vector3 &norm){
-	//Make sure this is a border cell?????
-	if (g_col->getValue(iX, iY, iZ) <= 0)
-		return false;
-	norm[0] = g_col->getValue(iX-1,iY,iZ) - g_col->getValue(iX+1,iY,iZ);
-	norm[1] = g_col->getValue(iX,iY-1,iZ) - g_col->getValue(iX,iY+1,iZ);
-	norm[2] = g_col->getValue(iX,iY,iZ-1) - g_col->getValue(iX,iY,iZ+1);
-	norm.normalize();
-	return true;
-}
-
-
-
@@ -3,7 +3,12 @@
 
 #include <GAS/GAS_SubSolver.h>
 #include <GAS/GAS_Utils.h>
-#include <math.h>
+#include <GU/GU_Detail.h>
+#include <GA/GA_Handle.h>
+#include <UT/UT_ThreadedAlgorithm.h>
+#include <UT/UT_Thread.h>
+#include <UT/UT_VoxelArray.h>
+#include "SnowCore.h"
 
 #define MPM_PARTICLES "particles"
 #define MPM_P_FE "p_fe"
@@ -13,6 +18,8 @@
 #define MPM_P_D "p_d"
 #define MPM_P_W "p_w"
 #define MPM_P_WG "p_wg"
+#define MPM_P_SVDQ "p_svdq"
+#define MPM_P_JP "p_jp"
 
 #define MPM_G_MASS "g_mass"
 #define MPM_G_NVEL "g_nvel"
@@ -40,14 +47,25 @@
 #define MPM_BBOX_MIN "bbox_min"
 #define MPM_BBOX_MAX "bbox_max"
 
-typedef double freal;
+//Houdini's versions of the core's vectors and matrices
 typedef UT_Vector3T<freal> vector3;
 typedef UT_Matrix3T<freal> matrix3;
 
-static const int BSPLINE_RADIUS = 2;			//Radius of B-spline interpolation function
-static const freal EPSILON = 1e-10;
+//Point attributes the solver copies in and out of the core
+typedef struct SnowAttributes{
+	GA_RWHandleT<vector3> position, velocity;
+	GA_RWHandleT<freal> volume, density, jp;
+	GA_RWHandleT<matrix3> def_elastic, def_plastic;
+	GA_RWHandleT<UT_Vector4T<freal> > svd_rotation;
+} SnowAttributes;
+//Fields the solver copies in and out of the core's grid
+typedef struct SnowFields{
+	UT_VoxelArrayF *mass, *active, *col,
+		*ovel[3], *nvel[3], *col_vel[3], *ext_force[3];
+} SnowFields;
 
-class SIM_SnowSolver : public GAS_SubSolver{
+//The core's loops run on Houdini's threads (it's a SnowJobs)
+class SIM_SnowSolver : public GAS_SubSolver, public SnowJobs{
 public:
 	GET_DATA_FUNC_S(MPM_PARTICLES, Particles);
 	GET_DATA_FUNC_S(MPM_P_FE, PFe);
@@ -57,6 +75,8 @@ public:
 	GET_DATA_FUNC_S(MPM_P_D, PD);
 	GET_DATA_FUNC_S(MPM_P_W, PW);
 	GET_DATA_FUNC_S(MPM_P_WG, PWg);
+	GET_DATA_FUNC_S(MPM_P_SVDQ, PSvdq);
+	GET_DATA_FUNC_S(MPM_P_JP, PJp);
 
 	GET_DATA_FUNC_S(MPM_G_MASS, GMass);
 	GET_DATA_FUNC_S(MPM_G_NVEL, GNvel);
@@ -90,6 +110,33 @@ protected:
 
 	//Runs our sub-solver for a single object
 	virtual bool solveGasSubclass(SIM_Engine &engine, SIM_Object *obj, SIM_Time time, SIM_Time timestep);
+
+	//SnowJobs: chunks of each loop are handed out to the threads as they finish
+	//their last one, since particles are rarely spread evenly
+	virtual void run(SnowCore* core, SnowTask task, int count, int chunk){
+		runJobs(core, task, count, chunk);
+	}
+	virtual int threads() const{
+		return UT_Thread::getNumProcessors();
+	}
+	THREADED_METHOD4(SIM_SnowSolver, count > chunk, runJobs,
+		SnowCore*, core,
+		SnowTask, task,
+		int, count,
+		int, chunk);
+	void runJobsPartial(SnowCore* core, SnowTask task, int count, int chunk, const UT_JobInfo &info);
+
+	//Copying particles in and out of the core, a page of points per job at a time
+	THREADED_METHOD3(SIM_SnowSolver, gdp->getNumPoints() > GA_PAGE_SIZE, copyParticles,
+		const GU_Detail*, gdp,
+		SnowAttributes*, attributes,
+		bool, to_core);
+	void copyParticlesPartial(const GU_Detail* gdp, SnowAttributes* attributes, bool to_core, const UT_JobInfo &info);
+	//Copying fields in and out of the core's grid, a share of the tiles per job
+	THREADED_METHOD2(SIM_SnowSolver, fields->mass->numTiles() > 1, copyFields,
+		const SnowFields*, fields,
+		bool, to_core);
+	void copyFieldsPartial(const SnowFields* fields, bool to_core, const UT_JobInfo &info);
     
 private:
     //Allows this solver to be a DataFactory?
@@ -103,28 +150,10 @@ private:
 	);
     //Description of our sub-solver
     static const SIM_DopDescription *getDescription();
-    
-	static freal bspline(freal x){
-		x = fabs(x);
-		freal w;
-		if (x < 1)
-			w = x*x*(x/2 - 1) + 2/3.0;
-		else if (x < 2)
-			w = x*(x*(-x/6 + 1) - 2) + 4/3.0;
-		else return 0;
-		//Clamp between 0 and 1... if needed
-		if (w < EPSILON) return 0;
-		return w;
-	}
-	static freal bsplineSlope(freal x){
-		freal abs_x = fabs(x);
-		if (abs_x < 1)
-			return 1.5*x*abs_x - 2*x;
-		else if (x < 2)
-			return -x*abs_x/2 + 2*x - 2*x/abs_x;
-		else return 0;
-		//Clamp between -2/3 and 2/3... if needed
-	}
+
+	//The solver itself (see SnowCore.h); kept between substeps, so its buffers
+	//are only allocated once
+	SnowCore core;
 };
 
 #endif
@@ -0,0 +1,234 @@
+#ifndef SVD3_H
+#define	SVD3_H
+
+#include <math.h>
+#include <immintrin.h>
+
+/* Singular value decomposition of 3x3 matrices, without branches; based on:
+	McAdams et al., "Computing the Singular Value Decomposition of 3x3 matrices
+	with minimal branching and elementary floating point operations" (2011)
+	http://pages.cs.wisc.edu/~sifakis/project_pages/svd.html
+
+	A fixed number of Jacobi sweeps diagonalize A^T*A, which gives V (kept as a
+	quaternion); the columns of A*V are sorted by length, and Givens rotations
+	turn A*V into U*Sigma. Unlike the paper, the Jacobi rotations use the exact
+	angle rather than its approximation: the solver works in doubles, and snow's
+	singular values are all close to 1, where the approximate angles take many
+	more sweeps to get anywhere near double precision.
+
+	Every case is computed with selects instead of if's, so the same code works
+	on plain floats/doubles, or on SVDLanes vectors that decompose one matrix per
+	lane (comparisons give bools for scalars, but integer vectors for SVDLanes,
+	hence the __typeof__'s).
+
+	The results follow the same conventions as Eigen::JacobiSVD: singular values
+	are sorted from largest to smallest, and are never negative (U gets flipped
+	instead, when det(A) < 0).
+*/
+
+//Vectors of SVDLanes<T>::SIZE matrices; as wide as the widest registers we're compiled for
+#if defined(__AVX512F__)
+	#define SVD_VECTOR_BYTES 64
+#elif defined(__AVX__)
+	#define SVD_VECTOR_BYTES 32
+#else
+	#define SVD_VECTOR_BYTES 16
+#endif
+template<class T> struct SVDLanes{
+	enum{ SIZE = SVD_VECTOR_BYTES/sizeof(T) };
+	typedef T Vector __attribute__((vector_size(SVD_VECTOR_BYTES)));
+};
+//Jacobi sweeps; these are enough for double precision, starting from scratch or
+//from last step's rotation (see svd3)
+#define SVD_SWEEPS 4
+#define SVD_WARM_SWEEPS 3
+
+//Square roots, for scalars and each lane of a vector
+inline double svdSqrt(double x){
+	return sqrt(x);
+}
+inline float svdSqrt(float x){
+	return sqrtf(x);
+}
+inline SVDLanes<double>::Vector svdSqrt(const SVDLanes<double>::Vector& x){
+#if SVD_VECTOR_BYTES == 64
+	return (SVDLanes<double>::Vector) _mm512_sqrt_pd((__m512d) x);
+#elif SVD_VECTOR_BYTES == 32
+	return (SVDLanes<double>::Vector) _mm256_sqrt_pd((__m256d) x);
+#else
+	return (SVDLanes<double>::Vector) _mm_sqrt_pd((__m128d) x);
+#endif
+}
+inline SVDLanes<float>::Vector svdSqrt(const SVDLanes<float>::Vector& x){
+#if SVD_VECTOR_BYTES == 64
+	return (SVDLanes<float>::Vector) _mm512_sqrt_ps((__m512) x);
+#elif SVD_VECTOR_BYTES == 32
+	return (SVDLanes<float>::Vector) _mm256_sqrt_ps((__m256) x);
+#else
+	return (SVDLanes<float>::Vector) _mm_sqrt_ps((__m128) x);
+#endif
+}
+
+//One Jacobi rotation, in the plane of axes p and q (r is the other axis; p, q, r are
+//always in cyclic order). s holds the upper triangle of the symmetric matrix, which
+//gets conjugated by the rotation; the rotation's quaternion is appended to quat
+template<class T> inline void svdJacobi(T s[3][3], T quat[4], int p, int q, int r){
+	const T zero = T(), one = zero + 1;
+	T &s_pp = s[p][p], &s_qq = s[q][q],
+		&s_pq = p < q ? s[p][q] : s[q][p],
+		&s_pr = p < r ? s[p][r] : s[r][p],
+		&s_qr = q < r ? s[q][r] : s[r][q];
+	//Tangent of the (smallest) rotation angle that zeroes s[p][q], worked out so
+	//it never divides by s[p][q]; no rotation at all if s is already diagonal
+	T h = s_pp - s_qq,
+		abs_h = h < 0 ? -h : h,
+		den = abs_h + svdSqrt(h*h + 4*s_pq*s_pq),
+		t = den > 0 ? (h < 0 ? -2*s_pq : 2*s_pq)/(den > 0 ? den : one) : zero,
+		//Cosine/sine of the angle, and of half of it, for the quaternion
+		sec = svdSqrt(one + t*t),
+		c = one/sec,
+		sn = t*c,
+		th = t/(one + sec),
+		ch = one/svdSqrt(one + th*th),
+		sh = th*ch;
+	//Conjugate s by the rotation
+	T pp = s_pp, qq = s_qq, pq = s_pq, pr = s_pr, qr = s_qr;
+	s_pp = c*c*pp + 2*c*sn*pq + sn*sn*qq;
+	s_qq = sn*sn*pp - 2*c*sn*pq + c*c*qq;
+	s_pq = c*sn*(qq - pp) + (c*c - sn*sn)*pq;
+	s_pr = c*pr + sn*qr;
+	s_qr = c*qr - sn*pr;
+	//quat = quat * (ch, sh*axis r)
+	T x[3] = {quat[0], quat[1], quat[2]}, w = quat[3];
+	quat[p] = x[p]*ch + x[q]*sh;
+	quat[q] = x[q]*ch - x[p]*sh;
+	quat[r] = x[r]*ch + w*sh;
+	quat[3] = w*ch - x[r]*sh;
+}
+
+//Swap columns i and j of b and v if column j is longer, negating one of them so
+//v stays a rotation
+template<class T> inline void svdSwap(T b[3][3], T v[3][3], T len[3], int i, int j){
+	__typeof__(len[i] < len[j]) cond = len[i] < len[j];
+	for (int k=0; k<3; k++){
+		T bi = b[k][i], vi = v[k][i];
+		b[k][i] = cond ? b[k][j] : bi;
+		b[k][j] = cond ? -bi : b[k][j];
+		v[k][i] = cond ? v[k][j] : vi;
+		v[k][j] = cond ? -vi : v[k][j];
+	}
+	T li = len[i];
+	len[i] = cond ? len[j] : li;
+	len[j] = cond ? li : len[j];
+}
+
+//Givens rotation of rows i and j of r, zeroing r[j][col]; u gets the inverse
+//rotation on its columns, so u*r stays the same
+template<class T> inline void svdGivens(T r[3][3], T u[3][3], int i, int j, int col){
+	//A float constant, so it converts to float vectors too
+	const T zero = T(), one = zero + 1, epsilon = zero + 1e-30f;
+	T a1 = r[i][col], a2 = r[j][col],
+		len = svdSqrt(a1*a1 + a2*a2),
+		inv_len = one/(len > epsilon ? len : one),
+		c = len > epsilon ? a1*inv_len : one,
+		s = len > epsilon ? a2*inv_len : zero;
+	for (int k=0; k<3; k++){
+		T ri = r[i][k], rj = r[j][k];
+		r[i][k] = c*ri + s*rj;
+		r[j][k] = c*rj - s*ri;
+		T ui = u[k][i], uj = u[k][j];
+		u[k][i] = c*ui + s*uj;
+		u[k][j] = c*uj - s*ui;
+	}
+}
+
+//Rotation matrix of a unit quaternion (x, y, z, w)
+template<class T> inline void svdRotation(const T q[4], T m[3][3]){
+	const T one = T() + 1;
+	T xx = q[0]*q[0], yy = q[1]*q[1], zz = q[2]*q[2],
+		xy = q[0]*q[1], xz = q[0]*q[2], yz = q[1]*q[2],
+		wx = q[3]*q[0], wy = q[3]*q[1], wz = q[3]*q[2];
+	m[0][0] = one - 2*(yy + zz);
+	m[0][1] = 2*(xy - wz);
+	m[0][2] = 2*(xz + wy);
+	m[1][0] = 2*(xy + wz);
+	m[1][1] = one - 2*(xx + zz);
+	m[1][2] = 2*(yz - wx);
+	m[2][0] = 2*(xz - wy);
+	m[2][1] = 2*(yz + wx);
+	m[2][2] = one - 2*(xx + yy);
+}
+
+//A = u*diag(sigma)*v^T; matrices are [row][column]. quat is V's rotation before the
+//columns were sorted, as (x, y, z, w); if warm is set, it should hold the one from
+//last time (for a matrix that hasn't changed much), and fewer sweeps are needed.
+//T is a float, a double, or an SVDLanes vector of them
+template<class T> void svd3(const T a[3][3], T u[3][3], T sigma[3], T v[3][3], T quat[4], int sweeps, bool warm){
+	const T zero = T(), one = zero + 1;
+	if (!warm){
+		quat[0] = quat[1] = quat[2] = zero;
+		quat[3] = one;
+	}
+	//V starts off as last time's rotation, when warm starting
+	T b[3][3], s[3][3];
+	if (warm){
+		//Normalize, in case the quaternion drifted
+		T inv_len = one/svdSqrt(quat[0]*quat[0] + quat[1]*quat[1] + quat[2]*quat[2] + quat[3]*quat[3]);
+		for (int i=0; i<4; i++)
+			quat[i] *= inv_len;
+		svdRotation(quat, v);
+		for (int i=0; i<3; i++){
+			for (int j=0; j<3; j++)
+				b[i][j] = a[i][0]*v[0][j] + a[i][1]*v[1][j] + a[i][2]*v[2][j];
+		}
+	}
+	else{
+		for (int i=0; i<3; i++){
+			for (int j=0; j<3; j++)
+				b[i][j] = a[i][j];
+		}
+	}
+	//Symmetric (B^T*B); only the upper triangle is used
+	for (int i=0; i<3; i++){
+		for (int j=i; j<3; j++)
+			s[i][j] = b[0][i]*b[0][j] + b[1][i]*b[1][j] + b[2][i]*b[2][j];
+	}
+	//Jacobi sweeps
+	for (int sweep=0; sweep<sweeps; sweep++){
+		svdJacobi(s, quat, 0, 1, 2);
+		svdJacobi(s, quat, 1, 2, 0);
+		svdJacobi(s, quat, 2, 0, 1);
+	}
+	//V from the quaternion
+	T inv_len = one/svdSqrt(quat[0]*quat[0] + quat[1]*quat[1] + quat[2]*quat[2] + quat[3]*quat[3]);
+	for (int i=0; i<4; i++)
+		quat[i] *= inv_len;
+	svdRotation(quat, v);
+	//B = A*V; its columns are orthogonal, with lengths equal to the singular values
+	T len[3];
+	for (int j=0; j<3; j++){
+		for (int i=0; i<3; i++)
+			b[i][j] = a[i][0]*v[0][j] + a[i][1]*v[1][j] + a[i][2]*v[2][j];
+		len[j] = b[0][j]*b[0][j] + b[1][j]*b[1][j] + b[2][j]*b[2][j];
+	}
+	//Sort the columns, largest first
+	svdSwap(b, v, len, 0, 1);
+	svdSwap(b, v, len, 0, 2);
+	svdSwap(b, v, len, 1, 2);
+	//QR decomposition of B; R is diagonal, up to round-off
+	for (int i=0; i<3; i++){
+		for (int j=0; j<3; j++)
+			u[i][j] = i == j ? one : zero;
+	}
+	svdGivens(b, u, 0, 1, 0);
+	svdGivens(b, u, 0, 2, 0);
+	svdGivens(b, u, 1, 2, 1);
+	sigma[0] = b[0][0];
+	sigma[1] = b[1][1];
+	//Only the last one can be negative; make it positive, like Eigen does
+	for (int i=0; i<3; i++)
+		u[i][2] = b[2][2] < 0 ? -u[i][2] : u[i][2];
+	sigma[2] = b[2][2] < 0 ? -b[2][2] : b[2][2];
+}
+
+#endif
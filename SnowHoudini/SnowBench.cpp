@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "SnowCore.h"
+#include "SVD3.h"
+
+//Benchmark for SnowCore, without Houdini: a snowball dropped onto the floor of a
+//unit box. Reports the time spent in each step of the solver
+
+//Steps of a substep (used for profiling)
+enum BenchPhase{
+	BENCH_RESET,		//Clearing the grid
+	BENCH_MASS,			//#1: mass and weights
+	BENCH_VELOCITY,		//#3: velocity to grid
+	BENCH_FORCES,		//#4: plasticity and forces
+	BENCH_GRID,			//#4, #5: grid velocity update and collisions
+	BENCH_PARTICLES,	//#6, #7: grid to particles, and particle update
+	NUM_BENCH_PHASES
+};
+static const char* PHASE_NAMES[] = {"reset grid", "mass + weights", "velocity to grid", "forces", "grid update", "particle update"};
+
+//Runs SnowCore's loops on a pool of threads, like the 2D simulator's ThreadPool; the
+//calling thread takes part in the work, so a pool of one thread has no workers
+class BenchJobs : public SnowJobs{
+public:
+	BenchJobs(int num_threads) : generation(0), busy(0), quit(false), core(NULL), task(NULL), count(0), chunk(0), next(0){
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&start_cond, NULL);
+		pthread_cond_init(&done_cond, NULL);
+		workers.resize(num_threads-1);
+		for (int i=0; i<num_threads-1; i++)
+			pthread_create(&workers[i], NULL, worker, this);
+	}
+	virtual ~BenchJobs(){
+		pthread_mutex_lock(&lock);
+		quit = true;
+		pthread_cond_broadcast(&start_cond);
+		pthread_mutex_unlock(&lock);
+		for (int i=0, len=workers.size(); i<len; i++)
+			pthread_join(workers[i], NULL);
+		pthread_cond_destroy(&start_cond);
+		pthread_cond_destroy(&done_cond);
+		pthread_mutex_destroy(&lock);
+	}
+	virtual void run(SnowCore* core, SnowTask task, int count, int chunk){
+		if (count <= 0)
+			return;
+		//Not worth waking up the workers
+		if (workers.empty() || count <= chunk){
+			(core->*task)(0, count);
+			return;
+		}
+		pthread_mutex_lock(&lock);
+		this->core = core;
+		this->task = task;
+		this->count = count;
+		this->chunk = chunk;
+		next = 0;
+		busy = workers.size();
+		generation++;
+		pthread_cond_broadcast(&start_cond);
+		pthread_mutex_unlock(&lock);
+
+		process();
+
+		//Wait for workers to finish their last chunk
+		pthread_mutex_lock(&lock);
+		while (busy > 0)
+			pthread_cond_wait(&done_cond, &lock);
+		pthread_mutex_unlock(&lock);
+	}
+	virtual int threads() const{
+		return workers.size()+1;
+	}
+private:
+	std::vector<pthread_t> workers;
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond, done_cond;
+	//Incremented for each new task, so workers know when to start
+	unsigned int generation;
+	int busy;
+	bool quit;
+	//Current task
+	SnowCore* core;
+	SnowTask task;
+	int count, chunk;
+	volatile int next;
+
+	static void* worker(void* args){
+		BenchJobs* jobs = (BenchJobs*) args;
+		unsigned int seen = 0;
+		pthread_mutex_lock(&jobs->lock);
+		while (true){
+			while (jobs->generation == seen && !jobs->quit)
+				pthread_cond_wait(&jobs->start_cond, &jobs->lock);
+			if (jobs->quit)
+				break;
+			seen = jobs->generation;
+			pthread_mutex_unlock(&jobs->lock);
+
+			jobs->process();
+
+			pthread_mutex_lock(&jobs->lock);
+			if (--jobs->busy == 0)
+				pthread_cond_signal(&jobs->done_cond);
+		}
+		pthread_mutex_unlock(&jobs->lock);
+		return NULL;
+	}
+	//Process chunks of the current task until there are none left
+	void process(){
+		while (true){
+			int begin = __sync_fetch_and_add(&next, chunk);
+			if (begin >= count)
+				break;
+			int end = begin+chunk;
+			(core->*task)(begin, end > count ? count : end);
+		}
+	}
+};
+
+static double now(){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+//Uniform random number in [0, 1); the same sequence on every machine
+static freal random01(unsigned int& seed){
+	seed = seed*1103515245 + 12345;
+	return (seed >> 8)/(freal) (1 << 24);
+}
+
+void print_usage(const char* name){
+	fprintf(stderr,
+		"Usage: %s [-particles N] [-grid N] [-steps N] [-timestep T] [-threads N] [-weights MODE] [-warm-svd] [-scalar-jp]\n"
+		"       [-cfl C]\n"
+		"  -particles N   particles in the snowball (default 50000)\n"
+		"  -grid N        grid nodes along each axis (default 64)\n"
+		"  -steps N       substeps to run (default 200)\n"
+		"  -timestep T    substep length, in seconds (default 1e-4)\n"
+		"  -threads N     threads to run on (default: one per core)\n"
+		"  -weights MODE  how interpolation weights are kept: cached, separable\n"
+		"                 or recompute (default separable)\n"
+		"  -warm-svd      start each SVD from the particle's last rotation\n"
+		"  -scalar-jp     only keep the determinant of the plastic deformation gradient\n"
+		"  -cfl C         split each step of -timestep into as many substeps as the CFL\n"
+		"                 condition needs, like the plugin (default 0: no splitting)\n",
+		name
+	);
+}
+
+int main(int argc, char** argv){
+	int particle_count = 50000, grid_nodes = 64, steps = 200, threads = sysconf(_SC_NPROCESSORS_ONLN);
+	freal timestep = 1e-4, cfl = 0;
+	bool warm_svd = false, scalar_jp = false;
+	WeightMode weight_mode = MPM_WEIGHTS;
+	const char* weight_names[] = {"cached", "separable", "recompute"};
+	for (int i=1; i<argc; i++){
+		if (!strcmp(argv[i], "-particles") && i+1 < argc)
+			particle_count = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-grid") && i+1 < argc)
+			grid_nodes = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-steps") && i+1 < argc)
+			steps = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-timestep") && i+1 < argc)
+			timestep = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-threads") && i+1 < argc)
+			threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-weights") && i+1 < argc){
+			i++;
+			if (!strcmp(argv[i], "cached"))
+				weight_mode = WEIGHTS_CACHED;
+			else if (!strcmp(argv[i], "separable"))
+				weight_mode = WEIGHTS_SEPARABLE;
+			else if (!strcmp(argv[i], "recompute"))
+				weight_mode = WEIGHTS_RECOMPUTE;
+			else{
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!strcmp(argv[i], "-warm-svd"))
+			warm_svd = true;
+		else if (!strcmp(argv[i], "-scalar-jp"))
+			scalar_jp = true;
+		else if (!strcmp(argv[i], "-cfl") && i+1 < argc)
+			cfl = atof(argv[++i]);
+		else{
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (particle_count <= 0 || grid_nodes < 8 || steps <= 0 || timestep <= 0 || threads <= 0 || cfl < 0){
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	SnowCore core;
+	BenchJobs jobs(threads);
+	core.jobs = &jobs;
+	core.weight_mode = weight_mode;
+	//The paper's 3D material (the values in brackets in the 2D SimConstants.h)
+	SnowParameters &params = core.params;
+	const freal ball_radius = .15, ball_density = 400;
+	params.particle_mass = ball_density*4/3.0*M_PI*ball_radius*ball_radius*ball_radius/particle_count;
+	params.youngs_modulus = 1.4e5;
+	params.poissons_ratio = .2;
+	params.crit_compress = 1-2.5e-2;
+	params.crit_stretch = 1+7.5e-3;
+	params.flip_percent = .95;
+	params.hardening = 10;
+	params.cfl = cfl;
+	params.cof = .2;
+	params.max_velocity = 100;
+	params.gravity = eigen_vector3(0, -9.8, 0);
+
+	//Unit box, with a floor at y = .1
+	SnowGrid &grid = core.grid;
+	int divisions[3] = {grid_nodes, grid_nodes, grid_nodes};
+	core.resetGrid(divisions);
+	grid.cellsize.setConstant(1.0/(grid_nodes-1));
+	grid.origin.setZero();
+	const freal floor_height = .1;
+	for (int z=0; z<grid_nodes; z++){
+		for (int y=0; y<grid_nodes; y++){
+			for (int x=0; x<grid_nodes; x++){
+				SnowNodeInput &input = grid.inputs[grid.index(x, y, z)];
+				input.col_sdf = floor_height - y*grid.cellsize[1];
+				input.col_velocity.setZero();
+				input.ext_force.setZero();
+			}
+		}
+	}
+
+	//Snowball, thrown down and sideways
+	SnowParticles &particles = core.particles;
+	particles.warm_svd = warm_svd;
+	particles.scalar_jp = scalar_jp;
+	particles.resize(particle_count);
+	const eigen_vector3 center(.5, .3, .5), velocity(2, -5, 0);
+	unsigned int seed = 1;
+	for (int i=0; i<particle_count; i++){
+		eigen_vector3 offset;
+		do{
+			offset = eigen_vector3(random01(seed), random01(seed), random01(seed))*2 - eigen_vector3::Ones();
+		} while (offset.squaredNorm() > 1);
+		particles.position[i] = center + offset*ball_radius;
+		particles.velocity[i] = velocity;
+		particles.def_elastic[i].setIdentity();
+		if (scalar_jp)
+			particles.jp[i] = 1;
+		else particles.def_plastic[i].setIdentity();
+		if (warm_svd)
+			particles.svd_rotation[i] = eigen_vector4(0, 0, 0, 1);
+	}
+	//We need to estimate particle volumes before we start
+	core.rasterizeMass();
+	core.estimateVolumes();
+
+	printf("Snowball: %d particles, %dx%dx%d grid nodes, %d %s of %g s\n",
+		particle_count, grid_nodes, grid_nodes, grid_nodes, steps, cfl > 0 ? "steps" : "substeps", timestep);
+	printf("%d thread%s; %s precision; %s weights; SVD: %d particles at a time, %s; %s plastic gradient\n",
+		threads, threads > 1 ? "s" : "", SNOW_DOUBLE ? "double" : "single", weight_names[weight_mode], (int) SVDLanes<freal>::SIZE,
+		warm_svd ? "warm started" : "cold started", scalar_jp ? "scalar" : "full");
+	if (cfl > 0)
+		printf("Substeps picked by the CFL condition, with CFL %g\n", cfl);
+
+	double phase_time[NUM_BENCH_PHASES] = {};
+	double start = now();
+	int substeps_run = 0;
+	for (int step=0; step<steps; step++){
+		//Same split as SIM_SnowSolver; the CFL check counts as part of resetting the grid
+		double last = now(), cur;
+		freal stable = core.stableTimestep();
+		int substeps = stable > 0 && stable < timestep ? (int) ceil(timestep/stable) : 1;
+		freal substep = timestep/substeps;
+		for (int sub=0; sub<substeps; sub++, substeps_run++){
+			core.resetGrid(divisions);
+			cur = now(); phase_time[BENCH_RESET] += cur-last; last = cur;
+			core.rasterizeMass();
+			cur = now(); phase_time[BENCH_MASS] += cur-last; last = cur;
+			core.transferVelocities();
+			cur = now(); phase_time[BENCH_VELOCITY] += cur-last; last = cur;
+			core.computeForces();
+			cur = now(); phase_time[BENCH_FORCES] += cur-last; last = cur;
+			core.updateVelocities(substep);
+			core.collideGrid();
+			cur = now(); phase_time[BENCH_GRID] += cur-last; last = cur;
+			core.updateParticles(substep);
+			cur = now(); phase_time[BENCH_PARTICLES] += cur-last; last = cur;
+		}
+	}
+	double wall_time = now()-start;
+
+	if (cfl > 0)
+		printf("\n%d substeps, %.1f per step\n", substeps_run, substeps_run/(double) steps);
+	printf("\nWall time: %.3f s, %.2f ms/substep, %.3g particle-substeps/s\n",
+		wall_time, wall_time*1e3/substeps_run, particle_count*(double) substeps_run/wall_time);
+	for (int i=0; i<NUM_BENCH_PHASES; i++){
+		printf("  %-18s %8.3f ms/substep  %5.1f%%  %7.1f ns/particle\n", PHASE_NAMES[i],
+			phase_time[i]*1e3/substeps_run, 100*phase_time[i]/wall_time, phase_time[i]*1e9/substeps_run/particle_count);
+	}
+	//To check that optimisations don't change the results
+	eigen_vector3 mean_position = eigen_vector3::Zero(), mean_velocity = eigen_vector3::Zero();
+	freal mean_jp = 0;
+	for (int i=0; i<particle_count; i++){
+		mean_position += particles.position[i];
+		mean_velocity += particles.velocity[i];
+		mean_jp += particles.plasticJ(i);
+	}
+	mean_position /= particle_count;
+	mean_velocity /= particle_count;
+	mean_jp /= particle_count;
+	printf("\nMean position (%.6f, %.6f, %.6f), velocity (%.6f, %.6f, %.6f), Jp %.6f\n",
+		mean_position[0], mean_position[1], mean_position[2],
+		mean_velocity[0], mean_velocity[1], mean_velocity[2], mean_jp);
+	return EXIT_SUCCESS;
+}
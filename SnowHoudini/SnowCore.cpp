@@ -0,0 +1,668 @@
+#include "SnowCore.h"
+#include "SVD3.h"
+
+//Particles per chunk, in loops over particles; a multiple of SVDLanes<freal>::SIZE,
+//so each chunk's SVDs fill whole vectors
+static const int PARTICLE_CHUNK = 256;
+
+//Interpolation weights and gradients of a particle's stencil, indexed by
+//(SIZE*(SIZE*z + y) + x), in the same order as the loops over its nodes; depending on
+//the weight mode, they are read from the cache, or computed from separable weights
+template<int mode> class SnowStencil{
+public:
+	SnowStencil(const SnowCore* core, int pid, const eigen_vector3& gpos) : cellsize(core->grid.cellsize){
+		if (mode == WEIGHTS_SEPARABLE)
+			axis = &core->axis_weights[pid*MPM_AXIS_WEIGHTS];
+		else{
+			core->axisWeights(gpos, axis_data);
+			axis = axis_data;
+		}
+	}
+
+	//Final weight is dyadic product of weights in each dimension
+	freal weight(int idx) const{
+		return axis[idx % n]*axis[n + idx/n % n]*axis[2*n + idx/(n*n)];
+	}
+	//Weight gradient is a vector of partial derivatives
+	eigen_vector3 gradient(int idx) const{
+		int x = idx % n, y = idx/n % n, z = idx/(n*n);
+		const freal *w = axis, *d = axis + 3*n;
+		return eigen_vector3(d[x]*w[n+y]*w[2*n+z], w[x]*d[n+y]*w[2*n+z], w[x]*w[n+y]*d[2*n+z]).cwiseQuotient(cellsize);
+	}
+
+private:
+	enum{ n = MPMKernel::SIZE };
+	const eigen_vector3 &cellsize;
+	const freal* axis;
+	freal axis_data[MPM_AXIS_WEIGHTS];
+};
+template<> class SnowStencil<WEIGHTS_CACHED>{
+public:
+	SnowStencil(const SnowCore* core, int pid, const eigen_vector3& /*gpos*/) :
+		weights(&core->weights[pid*MPM_STENCIL]),
+		weight_gradients(&core->weight_gradients[pid*MPM_STENCIL]){}
+
+	freal weight(int idx) const{
+		return weights[idx];
+	}
+	const eigen_vector3& gradient(int idx) const{
+		return weight_gradients[idx];
+	}
+
+private:
+	const freal* weights;
+	const eigen_vector3* weight_gradients;
+};
+
+SnowCore::SnowCore() : weight_mode(MPM_WEIGHTS), scatter_color(0), step_timestep(0){
+	static SnowJobs serial;
+	jobs = &serial;
+	for (int i=0; i<3; i++)
+		blocks[i] = 0;
+	bin_ranges = 0;
+}
+
+void SnowCore::resetGrid(const int divisions[3]){
+	grid.resize(divisions);
+	jobs->run(this, &SnowCore::clearSlices, grid.size[2], 1);
+}
+void SnowCore::clearSlices(int begin, int end){
+	for (int i=grid.index(0,0,begin), i_end=grid.index(0,0,end); i<i_end; i++){
+		SnowNode &node = grid.nodes[i];
+		node.mass = 0;
+		node.active = false;
+		node.velocity.setZero();
+		node.velocity_new.setZero();
+		node.force.setZero();
+	}
+}
+
+//Particles far apart in memory can touch the same nodes, so they can't be scattered
+//to the grid in parallel as they are; instead, they're binned by grid block, and the
+//blocks of each color are scattered in parallel (like the 2D simulator's grid)
+void SnowCore::binParticles(){
+	int count = particles.size(), num_blocks = 1;
+	//Split grid into blocks, and color them in a 3D checkerboard pattern (eight colors)
+	for (int i=0; i<3; i++){
+		blocks[i] = (grid.size[i] + GRID_BLOCK-1)/GRID_BLOCK;
+		num_blocks *= blocks[i];
+	}
+	for (int c=0; c<BLOCK_COLORS; c++)
+		color_blocks[c].clear();
+	for (int bz=0, b=0; bz<blocks[2]; bz++){
+		for (int by=0; by<blocks[1]; by++){
+			for (int bx=0; bx<blocks[0]; bx++, b++)
+				color_blocks[(bx & 1) + 2*(by & 1) + 4*(bz & 1)].push_back(b);
+		}
+	}
+	particle_block.resize(count);
+	jobs->run(this, &SnowCore::findBlocks, count, PARTICLE_CHUNK);
+
+	//Counting sort of particles by block; each range of particles is counted and
+	//placed on its own, so the final order doesn't depend on timing
+	bin_ranges = jobs->threads();
+	bin_offsets.assign(bin_ranges*num_blocks, 0);
+	block_start.resize(num_blocks+1);
+	block_particles.resize(count);
+	jobs->run(this, &SnowCore::countBins, bin_ranges, 1);
+	//Prefix sum gives where each range starts writing in each block
+	for (int b=0, offset=0; b<num_blocks; b++){
+		block_start[b] = offset;
+		for (int r=0; r<bin_ranges; r++){
+			int& bin = bin_offsets[r*num_blocks+b];
+			int temp = bin;
+			bin = offset;
+			offset += temp;
+		}
+	}
+	block_start[num_blocks] = count;
+	jobs->run(this, &SnowCore::placeBins, bin_ranges, 1);
+}
+void SnowCore::findBlocks(int begin, int end){
+	for (int pid=begin; pid<end; pid++){
+		//Block of the particle's first node; particles outside the grid only touch nodes
+		//near its edge, so they go in the nearest block
+		eigen_vector3 gpos = grid.gridPosition(particles.position[pid]);
+		int block[3];
+		for (int i=0; i<3; i++){
+			int first = MPMKernel::first(gpos[i]);
+			block[i] = first < 0 ? 0 : first/GRID_BLOCK;
+			if (block[i] >= blocks[i])
+				block[i] = blocks[i]-1;
+		}
+		particle_block[pid] = block[0] + blocks[0]*(block[1] + blocks[1]*block[2]);
+	}
+}
+void SnowCore::countBins(int begin, int end){
+	int count = particles.size(), num_blocks = blocks[0]*blocks[1]*blocks[2];
+	for (int r=begin; r<end; r++){
+		int* bins = &bin_offsets[r*num_blocks];
+		for (int i=count*(long) r/bin_ranges, i_end=count*(long) (r+1)/bin_ranges; i<i_end; i++)
+			bins[particle_block[i]]++;
+	}
+}
+void SnowCore::placeBins(int begin, int end){
+	int count = particles.size(), num_blocks = blocks[0]*blocks[1]*blocks[2];
+	for (int r=begin; r<end; r++){
+		int* offsets = &bin_offsets[r*num_blocks];
+		for (int i=count*(long) r/bin_ranges, i_end=count*(long) (r+1)/bin_ranges; i<i_end; i++)
+			block_particles[offsets[particle_block[i]]++] = i;
+	}
+}
+
+//Scatter each particle to the grid, using the given kernel
+template<void (SnowCore::*kernel)(int)>
+void SnowCore::scatter(){
+	//Blocks of the same color never scatter to the same node,
+	//so we can do one color at a time without any locking
+	for (scatter_color=0; scatter_color<BLOCK_COLORS; scatter_color++)
+		jobs->run(this, &SnowCore::scatterBlocks<kernel>, color_blocks[scatter_color].size(), 1);
+}
+template<void (SnowCore::*kernel)(int)>
+void SnowCore::scatterBlocks(int begin, int end){
+	const std::vector<int>& color = color_blocks[scatter_color];
+	for (int b=begin; b<end; b++){
+		int block = color[b];
+		for (int j=block_start[block], j_end=block_start[block+1]; j<j_end; j++)
+			(this->*kernel)(block_particles[j]);
+	}
+}
+
+freal SnowCore::stableTimestep(){
+	int count = particles.size();
+	if (params.cfl <= 0 || !count)
+		return 0;
+	chunk_speeds.resize((count + PARTICLE_CHUNK-1)/PARTICLE_CHUNK);
+	jobs->run(this, &SnowCore::waveSpeedTask, count, PARTICLE_CHUNK);
+	freal max_speed = 0;
+	for (int c=0, len=chunk_speeds.size(); c<len; c++){
+		//Written so that a NaN, if the particles have blown up, sticks
+		if (!(chunk_speeds[c] <= max_speed) && max_speed == max_speed)
+			max_speed = chunk_speeds[c];
+	}
+	if (!(max_speed > EPSILON))
+		return 0;
+	return params.cfl*grid.cellsize.minCoeff()/max_speed;
+}
+//Each particle's speed, plus the speed of pressure waves through it: sqrt((lambda + 2*mu)/density),
+//with the Lame parameters scaled by hardening, as in plasticityTask
+void SnowCore::waveSpeedTask(int begin, int end){
+	freal mu = params.youngs_modulus/(2+2*params.poissons_ratio),
+		lambda = params.youngs_modulus*params.poissons_ratio/((1+params.poissons_ratio)*(1-2*params.poissons_ratio)),
+		modulus = (lambda + 2*mu)/params.particle_mass;
+	//Tasks can be given several chunks at once
+	for (int chunk=begin; chunk<end; chunk+=PARTICLE_CHUNK){
+		freal max_speed = 0;
+		for (int pid=chunk, pid_end=chunk+PARTICLE_CHUNK < end ? chunk+PARTICLE_CHUNK : end; pid<pid_end; pid++){
+			freal wave = sqrt(modulus*particles.volume[pid]*exp(params.hardening*(1-particles.plasticJ(pid)))),
+				speed = particles.velocity[pid].norm() + wave;
+			if (!(speed <= max_speed) && max_speed == max_speed)
+				max_speed = speed;
+		}
+		chunk_speeds[chunk/PARTICLE_CHUNK] = max_speed;
+	}
+}
+
+void SnowCore::step(freal timestep){
+	rasterizeMass();
+	transferVelocities();
+	computeForces();
+	updateVelocities(timestep);
+	collideGrid();
+	updateParticles(timestep);
+}
+
+void SnowCore::rasterizeMass(){
+	//Only the buffers the weight mode needs are kept
+	int count = particles.size();
+	if (weight_mode == WEIGHTS_CACHED){
+		weights.resize(count*MPM_STENCIL);
+		weight_gradients.resize(count*MPM_STENCIL);
+	}
+	else{
+		std::vector<freal>().swap(weights);
+		std::vector<eigen_vector3>().swap(weight_gradients);
+	}
+	if (weight_mode == WEIGHTS_SEPARABLE)
+		axis_weights.resize(count*MPM_AXIS_WEIGHTS);
+	else std::vector<freal>().swap(axis_weights);
+
+	binParticles();
+	switch (weight_mode){
+		case WEIGHTS_CACHED: scatter<&SnowCore::rasterizeParticle<WEIGHTS_CACHED> >(); break;
+		case WEIGHTS_SEPARABLE: scatter<&SnowCore::rasterizeParticle<WEIGHTS_SEPARABLE> >(); break;
+		case WEIGHTS_RECOMPUTE: scatter<&SnowCore::rasterizeParticle<WEIGHTS_RECOMPUTE> >(); break;
+	}
+}
+template<int mode> void SnowCore::rasterizeParticle(int pid){
+	//Get grid position
+	eigen_vector3 gpos = grid.gridPosition(particles.position[pid]);
+	//Compute weights, and store them (if the mode keeps them)
+	if (mode == WEIGHTS_SEPARABLE)
+		axisWeights(gpos, &axis_weights[pid*MPM_AXIS_WEIGHTS]);
+	SnowStencil<mode == WEIGHTS_CACHED ? (int) WEIGHTS_RECOMPUTE : mode> stencil(this, pid, gpos);
+	freal* p_w = mode == WEIGHTS_CACHED ? &weights[pid*MPM_STENCIL] : NULL;
+	eigen_vector3* p_wgh = mode == WEIGHTS_CACHED ? &weight_gradients[pid*MPM_STENCIL] : NULL;
+	//Transfer mass
+	//Nodes outside the grid get no weight, so nothing is transferred to or from them
+	//(skipping them also keeps the particle's writes within reach of its block)
+	for (int idx=0, z=MPMKernel::first(gpos[2]), z_end=z+MPMKernel::SIZE; z<z_end; z++){
+		for (int y=MPMKernel::first(gpos[1]), y_end=y+MPMKernel::SIZE; y<y_end; y++){
+			for (int x=MPMKernel::first(gpos[0]), x_end=x+MPMKernel::SIZE; x<x_end; x++, idx++){
+				freal weight = stencil.weight(idx);
+				if (mode == WEIGHTS_CACHED){
+					p_w[idx] = weight;
+					p_wgh[idx] = stencil.gradient(idx);
+				}
+
+				//Interpolate mass
+				if (weight > 0)
+					grid.nodes[grid.clampedIndex(x,y,z)].mass += weight*params.particle_mass;
+			}
+		}
+	}
+}
+//Weights along x, y and z, then slopes along x, y and z; nodes outside
+//the grid get zero
+void SnowCore::axisWeights(const eigen_vector3& gpos, freal* axis) const{
+	const int n = MPMKernel::SIZE;
+	for (int i=0; i<3; i++){
+		for (int j=0, node=MPMKernel::first(gpos[i]); j<n; j++, node++){
+			freal pos = gpos[i]-node;
+			bool inside = grid.inside(i, node);
+			axis[i*n+j] = inside ? MPMKernel::weight(pos) : 0;
+			axis[(3+i)*n+j] = inside ? MPMKernel::slope(pos) : 0;
+		}
+	}
+}
+
+void SnowCore::estimateVolumes(){
+	int count = particles.size();
+	switch (weight_mode){
+		case WEIGHTS_CACHED: jobs->run(this, &SnowCore::estimateVolumesTask<WEIGHTS_CACHED>, count, PARTICLE_CHUNK); break;
+		case WEIGHTS_SEPARABLE: jobs->run(this, &SnowCore::estimateVolumesTask<WEIGHTS_SEPARABLE>, count, PARTICLE_CHUNK); break;
+		case WEIGHTS_RECOMPUTE: jobs->run(this, &SnowCore::estimateVolumesTask<WEIGHTS_RECOMPUTE>, count, PARTICLE_CHUNK); break;
+	}
+}
+template<int mode> void SnowCore::estimateVolumesTask(int begin, int end){
+	freal voxelArea = grid.cellsize.prod();
+	//Iterate through particles
+	for (int pid=begin; pid<end; pid++){
+		freal density = 0;
+		//Get grid position
+		eigen_vector3 gpos = grid.gridPosition(particles.position[pid]);
+		SnowStencil<mode> stencil(this, pid, gpos);
+		//Transfer grid density (within radius) to particles
+		for (int idx=0, z=MPMKernel::first(gpos[2]), z_end=z+MPMKernel::SIZE; z<z_end; z++){
+			for (int y=MPMKernel::first(gpos[1]), y_end=y+MPMKernel::SIZE; y<y_end; y++){
+				for (int x=MPMKernel::first(gpos[0]), x_end=x+MPMKernel::SIZE; x<x_end; x++, idx++){
+					freal w = stencil.weight(idx);
+					if (w > EPSILON){
+						//Transfer density
+						density += w * grid.nodes[grid.clampedIndex(x,y,z)].mass;
+					}
+				}
+			}
+		}
+
+		density /= voxelArea;
+		particles.density[pid] = density;
+		particles.volume[pid] = params.particle_mass/density;
+	}
+}
+
+void SnowCore::transferVelocities(){
+	//This must happen after transferring mass, to conserve momentum
+	switch (weight_mode){
+		case WEIGHTS_CACHED: scatter<&SnowCore::transferParticle<WEIGHTS_CACHED> >(); break;
+		case WEIGHTS_SEPARABLE: scatter<&SnowCore::transferParticle<WEIGHTS_SEPARABLE> >(); break;
+		case WEIGHTS_RECOMPUTE: scatter<&SnowCore::transferParticle<WEIGHTS_RECOMPUTE> >(); break;
+	}
+	jobs->run(this, &SnowCore::normalizeSlices, grid.size[2], 1);
+}
+template<int mode> void SnowCore::transferParticle(int pid){
+	eigen_vector3 vel_fac = particles.velocity[pid]*params.particle_mass;
+
+	//Get grid position
+	eigen_vector3 gpos = grid.gridPosition(particles.position[pid]);
+	SnowStencil<mode> stencil(this, pid, gpos);
+
+	//Transfer to grid nodes within radius
+	for (int idx=0, z=MPMKernel::first(gpos[2]), z_end=z+MPMKernel::SIZE; z<z_end; z++){
+		for (int y=MPMKernel::first(gpos[1]), y_end=y+MPMKernel::SIZE; y<y_end; y++){
+			for (int x=MPMKernel::first(gpos[0]), x_end=x+MPMKernel::SIZE; x<x_end; x++, idx++){
+				freal w = stencil.weight(idx);
+				if (w > EPSILON){
+					SnowNode &node = grid.nodes[grid.clampedIndex(x,y,z)];
+					node.velocity += vel_fac*w;
+					node.active = true;
+				}
+			}
+		}
+	}
+}
+void SnowCore::normalizeSlices(int begin, int end){
+	//Division is slow (maybe?); we only want to do divide by mass once, for each active node
+	for (int i=grid.index(0,0,begin), i_end=grid.index(0,0,end); i<i_end; i++){
+		SnowNode &node = grid.nodes[i];
+		//Only check nodes that have mass
+		if (node.active)
+			node.velocity *= 1/node.mass;
+	}
+}
+
+void SnowCore::computeForces(){
+	stress.resize(particles.size());
+	jobs->run(this, &SnowCore::plasticityTask, particles.size(), PARTICLE_CHUNK);
+	switch (weight_mode){
+		case WEIGHTS_CACHED: scatter<&SnowCore::forceParticle<WEIGHTS_CACHED> >(); break;
+		case WEIGHTS_SEPARABLE: scatter<&SnowCore::forceParticle<WEIGHTS_SEPARABLE> >(); break;
+		case WEIGHTS_RECOMPUTE: scatter<&SnowCore::forceParticle<WEIGHTS_RECOMPUTE> >(); break;
+	}
+}
+//Plasticity, and each particle's stress; everything here is per particle, so the
+//temporaries are local to each chunk (and thread)
+void SnowCore::plasticityTask(int begin, int end){
+	freal mu = params.youngs_modulus/(2+2*params.poissons_ratio),
+		lambda = params.youngs_modulus*params.poissons_ratio/((1+params.poissons_ratio)*(1-2*params.poissons_ratio));
+
+	//The SVDs are done SVD_LANES particles at a time (see SVD3.h)
+	typedef SVDLanes<freal>::Vector svd_vector;
+	const int SVD_LANES = SVDLanes<freal>::SIZE;
+	svd_vector lanes_a[3][3], lanes_u[3][3], lanes_e[3], lanes_v[3][3], lanes_q[4];
+	bool warm = particles.warm_svd;
+
+	eigen_matrix3 def_elastic, def_plastic, energy, svd_u, svd_v;
+	eigen_vector3 svd_e;
+
+	//Compute the stress of each particle
+	for (int pid=begin; pid<end; pid++){
+		int lane = (pid-begin) % SVD_LANES;
+
+		//Compute singular value decomposition (uev*), for this particle and the next few
+		if (lane == 0){
+			for (int l=0; l<SVD_LANES; l++){
+				//Unused lanes get the identity
+				eigen_matrix3 fe = eigen_matrix3::Identity();
+				eigen_vector4 q(0, 0, 0, 1);
+				if (pid+l < end){
+					fe = particles.def_elastic[pid+l];
+					if (warm){
+						q = particles.svd_rotation[pid+l];
+						//New particles start off with no rotation
+						if (q.squaredNorm() < EPSILON)
+							q = eigen_vector4(0, 0, 0, 1);
+					}
+				}
+				for (int i=0; i<3; i++){
+					for (int j=0; j<3; j++)
+						lanes_a[i][j][l] = fe(i,j);
+				}
+				for (int i=0; i<4; i++)
+					lanes_q[i][l] = q[i];
+			}
+			svd3(lanes_a, lanes_u, lanes_e, lanes_v, lanes_q, warm ? SVD_WARM_SWEEPS : SVD_SWEEPS, warm);
+			if (warm){
+				for (int l=0; l<SVD_LANES && pid+l < end; l++)
+					particles.svd_rotation[pid+l] = eigen_vector4(lanes_q[0][l], lanes_q[1][l], lanes_q[2][l], lanes_q[3][l]);
+			}
+		}
+		for (int i=0; i<3; i++){
+			svd_e[i] = lanes_e[i][lane];
+			for (int j=0; j<3; j++){
+				svd_u(i,j) = lanes_u[i][j][lane];
+				svd_v(i,j) = lanes_v[i][j][lane];
+			}
+		}
+
+		//Apply plasticity to deformation gradient, before computing forces
+		def_elastic = particles.def_elastic[pid];
+		//Stretch before clamping (the determinant of def_elastic, up to sign)
+		freal stretch = svd_e.prod();
+		//Clamp singular values
+		for (int i=0; i<3; i++){
+			if (svd_e[i] < params.crit_compress)
+				svd_e[i] = params.crit_compress;
+			else if (svd_e[i] > params.crit_stretch)
+				svd_e[i] = params.crit_stretch;
+		}
+		//Put SVD back together for new elastic and plastic gradients
+		//The plastic gradient has always been updated as Fp*Fe*Fe_new^-1 here, rather than
+		//Fe_new^-1*Fe*Fp; only its determinant is used, which is the same either way
+		//Je is the determinant of def_elastic (equivalent to svd_e.prod())
+		freal Je = svd_e.prod(), jp;
+		if (particles.scalar_jp){
+			//det(Fp*Fe*Fe_new^-1) = det(Fp)*det(Fe)/det(Fe_new); the signs of U and V cancel
+			jp = particles.jp[pid]*stretch/Je;
+			particles.jp[pid] = jp;
+		}
+		else{
+			def_plastic = particles.def_plastic[pid] * def_elastic * svd_v * svd_e.asDiagonal().inverse() * svd_u.transpose();
+			jp = def_plastic.determinant();
+			particles.def_plastic[pid] = def_plastic;
+		}
+		svd_v.transposeInPlace();
+		def_elastic = svd_u * svd_e.asDiagonal() * svd_v;
+
+		//Now compute the energy partial derivative (which we use to get force at each grid node)
+		//Note this is Fe^T*(Fe - R), rather than the paper's (Fe - R)*Fe^T; the solver
+		//has always computed it this way
+		energy = 2*mu*def_elastic.transpose()*(def_elastic - svd_u*svd_v);
+		freal contour = lambda*Je*(Je-1),
+			particle_vol = particles.volume[pid];
+		for (int i=0; i<3; i++)
+			energy(i,i) += contour;
+		energy *=  particle_vol * exp(params.hardening*(1-jp));
+
+		particles.def_elastic[pid] = def_elastic;
+		stress[pid] = energy;
+	}
+}
+template<int mode> void SnowCore::forceParticle(int pid){
+	//Transfer energy to surrounding grid nodes
+	const eigen_matrix3 &energy = stress[pid];
+	eigen_vector3 gpos = grid.gridPosition(particles.position[pid]);
+	SnowStencil<mode> stencil(this, pid, gpos);
+	for (int idx=0, z=MPMKernel::first(gpos[2]), z_end=z+MPMKernel::SIZE; z<z_end; z++){
+		for (int y=MPMKernel::first(gpos[1]), y_end=y+MPMKernel::SIZE; y<y_end; y++){
+			for (int x=MPMKernel::first(gpos[0]), x_end=x+MPMKernel::SIZE; x<x_end; x++, idx++){
+				freal w = stencil.weight(idx);
+				if (w > EPSILON)
+					grid.nodes[grid.clampedIndex(x,y,z)].force += energy*stencil.gradient(idx);
+			}
+		}
+	}
+}
+
+void SnowCore::updateVelocities(freal timestep){
+	step_timestep = timestep;
+	jobs->run(this, &SnowCore::updateSlices, grid.size[2], 1);
+}
+void SnowCore::updateSlices(int begin, int end){
+	freal timestep = step_timestep;
+	//Use new forces to solve for new velocities
+	for (int i=grid.index(0,0,begin), i_end=grid.index(0,0,end); i<i_end; i++){
+		SnowNode &node = grid.nodes[i];
+		//Only compute for active nodes
+		if (node.active){
+			freal node_mass = 1/node.mass;
+			eigen_vector3 g_nvel = node.velocity + timestep*(params.gravity + grid.inputs[i].ext_force - node.force*node_mass);
+
+			//Limit velocity to max_vel
+			freal nvelNorm = g_nvel.norm();
+			if(nvelNorm > params.max_velocity){
+				freal velRatio = params.max_velocity/nvelNorm;
+				g_nvel*= velRatio;
+			}
+			node.velocity_new = g_nvel;
+		}
+	}
+}
+
+void SnowCore::collideGrid(){
+	jobs->run(this, &SnowCore::collideSlices, grid.size[2], 1);
+}
+void SnowCore::collideSlices(int begin, int end){
+	eigen_vector3 sdf_normal;
+	//Nodes on the border of the grid are left alone
+	for (int iZ=begin > 1 ? begin : 1, iZ_end=end < grid.size[2]-1 ? end : grid.size[2]-1; iZ < iZ_end; iZ++){
+		for (int iY=1; iY < grid.size[1]-1; iY++){
+			for (int iX=1, i=grid.index(iX,iY,iZ); iX < grid.size[0]-1; iX++, i++){
+				SnowNode &node = grid.nodes[i];
+				if (node.active){
+					if (!computeSDFNormal(iX, iY, iZ, sdf_normal))
+						continue;
+
+					//Collider velocity
+					const eigen_vector3 &vco = grid.inputs[i].col_velocity;
+					//Grid velocity
+					const eigen_vector3 &v = node.velocity_new;
+					//Skip if bodies are separating
+					eigen_vector3 vrel = v - vco;
+
+					freal vn = vrel.dot(sdf_normal);
+					if (vn >= 0) continue;
+					//Resolve collisions; also add velocity of collision object to snow velocity
+					//Sticks to surface (too slow to overcome static friction)
+					eigen_vector3 vt = vrel - (sdf_normal*vn);
+
+					freal stick = vn*params.cof, vt_norm = vt.norm();
+					if (vt_norm <= -stick)
+						vt = vco;
+					//Dynamic friction
+					else vt += stick*vt/vt_norm + vco;
+
+					node.velocity_new = vt;
+				}
+			}
+		}
+	}
+}
+
+void SnowCore::updateParticles(freal timestep){
+	step_timestep = timestep;
+	int count = particles.size();
+	switch (weight_mode){
+		case WEIGHTS_CACHED: jobs->run(this, &SnowCore::updateParticlesTask<WEIGHTS_CACHED>, count, PARTICLE_CHUNK); break;
+		case WEIGHTS_SEPARABLE: jobs->run(this, &SnowCore::updateParticlesTask<WEIGHTS_SEPARABLE>, count, PARTICLE_CHUNK); break;
+		case WEIGHTS_RECOMPUTE: jobs->run(this, &SnowCore::updateParticlesTask<WEIGHTS_RECOMPUTE>, count, PARTICLE_CHUNK); break;
+	}
+}
+template<int mode> void SnowCore::updateParticlesTask(int begin, int end){
+	freal timestep = step_timestep;
+	freal voxelArea = grid.cellsize.prod();
+	eigen_vector3 pic, flip, col_vel, sdf_normal;
+	eigen_matrix3 vel_grad;
+	//Iterate through particles
+	for (int pid=begin; pid<end; pid++){
+		//Particle position
+		eigen_vector3 pos = particles.position[pid];
+
+		//Reset velocity
+		pic.setZero();
+		flip = particles.velocity[pid];
+		vel_grad.setZero();
+		freal density = 0;
+
+		//Get grid position
+		eigen_vector3 gpos = grid.gridPosition(pos);
+		int p_gridx = (int) gpos[0], p_gridy = (int) gpos[1], p_gridz = (int) gpos[2];
+		SnowStencil<mode> stencil(this, pid, gpos);
+		for (int idx=0, z=MPMKernel::first(gpos[2]), z_end=z+MPMKernel::SIZE; z<z_end; z++){
+			for (int y=MPMKernel::first(gpos[1]), y_end=y+MPMKernel::SIZE; y<y_end; y++){
+				for (int x=MPMKernel::first(gpos[0]), x_end=x+MPMKernel::SIZE; x<x_end; x++, idx++){
+					freal w = stencil.weight(idx);
+					if (w > EPSILON){
+						const eigen_vector3 &node_wg = stencil.gradient(idx);
+						const SnowNode &node = grid.nodes[grid.clampedIndex(x,y,z)];
+						const eigen_vector3 &node_nvel = node.velocity_new;
+
+						//Transfer velocities
+						pic += node_nvel*w;
+						flip += (node_nvel - node.velocity)*w;
+						//Transfer density
+						density += w * node.mass;
+						//Transfer veloctiy gradient
+						vel_grad += node_nvel*node_wg.transpose();
+					}
+				}
+			}
+		}
+
+		//Finalize velocity update
+		eigen_vector3 vel = flip*params.flip_percent + pic*(1-params.flip_percent);
+
+		//Reset collision data
+		freal col_sdf = 0;
+		sdf_normal.setZero();
+		col_vel.setZero();
+
+		//Interpolate surrounding nodes' SDF info to the particle (trilinear interpolation)
+		for (int z=p_gridz, z_end=z+1; z<=z_end; z++){
+			freal w_z = gpos[2]-z;
+			for (int y=p_gridy, y_end=y+1; y<=y_end; y++){
+				freal w_zy = w_z*(gpos[1]-y);
+				for (int x=p_gridx, x_end=x+1; x<=x_end; x++){
+					freal weight = fabs(w_zy*(gpos[0]-x));
+					eigen_vector3 temp_normal = eigen_vector3::Zero();
+					computeSDFNormal(x, y, z, temp_normal);
+					//Interpolate
+					const SnowNodeInput &input = grid.input(x, y, z);
+					sdf_normal += temp_normal*weight;
+					col_sdf += input.col_sdf*weight;
+					col_vel += input.col_velocity*weight;
+				}
+			}
+		}
+
+		//Resolve particle collisions
+		if (col_sdf > 0){
+			eigen_vector3 vrel = vel - col_vel;
+			freal vn = vrel.dot(sdf_normal);
+
+			//Skip if bodies are separating
+			if (vn < 0){
+				//Resolve and add velocity of collision object to snow velocity
+				//Sticks to surface (too slow to overcome static friction)
+				vel = vrel - (sdf_normal*vn);
+				freal stick = vn*params.cof, vel_norm = vel.norm();
+				if (vel_norm <= -stick)
+					vel = col_vel;
+				//Dynamic friction
+				else vel += stick*vel/vel_norm + col_vel;
+			}
+		}
+
+		//Finalize density update
+		density /= voxelArea;
+		particles.density[pid] = density;
+
+		//Update particle position
+		pos += timestep*vel;
+		particles.velocity[pid] = vel;
+		particles.position[pid] = pos;
+
+		//Update particle deformation gradient
+		//Note: plasticity is computed on the next timestep...
+		vel_grad *= timestep;
+		vel_grad(0,0) += 1;
+		vel_grad(1,1) += 1;
+		vel_grad(2,2) += 1;
+
+		particles.def_elastic[pid] = vel_grad*particles.def_elastic[pid];
+	}
+}
+
+bool SnowCore::computeSDFNormal(int iX, int iY, int iZ, eigen_vector3 &norm) const{
+	//Make sure this is a border cell?????
+	if (grid.input(iX, iY, iZ).col_sdf <= 0)
+		return false;
+	norm[0] = grid.input(iX-1,iY,iZ).col_sdf - grid.input(iX+1,iY,iZ).col_sdf;
+	norm[1] = grid.input(iX,iY-1,iZ).col_sdf - grid.input(iX,iY+1,iZ).col_sdf;
+	norm[2] = grid.input(iX,iY,iZ-1).col_sdf - grid.input(iX,iY,iZ+1).col_sdf;
+	//Eigen's normalize() would divide by zero where the SDF is flat
+	freal len = norm.norm();
+	if (len > 0)
+		norm /= len;
+	return true;
+}
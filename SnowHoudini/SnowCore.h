@@ -0,0 +1,351 @@
+#ifndef SNOWCORE_H
+#define	SNOWCORE_H
+
+#include <math.h>
+#include <vector>
+#include "Eigen/Dense"
+
+/* The 3D snow solver, without Houdini: particles, grid and the steps of one substep.
+	SIM_SnowSolver copies the Houdini particle attributes and fields in and out of
+	a SnowCore; anything else (like snowcore-bench) can fill one in directly.
+	Only depends on the bundled Eigen (see the Makefile).
+*/
+
+//Precision of everything in the core, particles and grid alike; floats halve the
+//memory (and cache) the particles and nodes take, and the SVDs do twice as many
+//particles at once. The plugin and libsnowcore must be built with the same setting
+#ifndef SNOW_DOUBLE
+#define SNOW_DOUBLE true
+#endif
+#if SNOW_DOUBLE
+typedef double freal;
+#else
+typedef float freal;
+#endif
+typedef Eigen::Matrix<freal,3,1> eigen_vector3;
+typedef Eigen::Matrix<freal,3,3> eigen_matrix3;
+//Unaligned, so they can go in a std::vector without Eigen's allocator
+typedef Eigen::Matrix<freal,4,1,Eigen::DontAlign> eigen_vector4;
+
+static const freal EPSILON = 1e-10;
+
+//Interpolation kernels; MPM_KERNEL picks the one the solver uses
+//SIZE is the number of nodes along each axis that a particle touches, and
+//first(x) gives the first of those nodes for a particle at grid position x
+#define MPM_KERNEL CubicBSpline
+
+//Cubic B-spline: 4x4x4 nodes per particle
+class CubicBSpline{
+public:
+	enum{ SIZE = 4 };
+
+	static int first(freal x){
+		return (int) x - 1;
+	}
+	//How far a particle can reach, in cells
+	static freal radius(){
+		return 2;
+	}
+	static freal weight(freal x){
+		x = fabs(x);
+		freal w;
+		if (x < 1)
+			w = x*x*(x/2 - 1) + 2/3.0;
+		else if (x < 2)
+			w = x*(x*(-x/6 + 1) - 2) + 4/3.0;
+		else return 0;
+		//Clamp between 0 and 1... if needed
+		if (w < EPSILON) return 0;
+		return w;
+	}
+	static freal slope(freal x){
+		freal abs_x = fabs(x);
+		if (abs_x < 1)
+			return 1.5*x*abs_x - 2*x;
+		else if (x < 2)
+			return -x*abs_x/2 + 2*x - 2*x/abs_x;
+		else return 0;
+		//Clamp between -2/3 and 2/3... if needed
+	}
+};
+//Quadratic B-spline: 3x3x3 nodes per particle, less smooth but less than half the work
+class QuadraticBSpline{
+public:
+	enum{ SIZE = 3 };
+
+	static int first(freal x){
+		return (int) (x - .5);
+	}
+	static freal radius(){
+		return 1.5;
+	}
+	static freal weight(freal x){
+		x = fabs(x);
+		freal w;
+		if (x < .5)
+			w = .75 - x*x;
+		else if (x < 1.5){
+			w = 1.5 - x;
+			w *= w/2;
+		}
+		else return 0;
+		if (w < EPSILON) return 0;
+		return w;
+	}
+	static freal slope(freal x){
+		freal abs_x = fabs(x);
+		if (abs_x < .5)
+			return -2*x;
+		else if (abs_x < 1.5)
+			return x < 0 ? x + 1.5 : x - 1.5;
+		else return 0;
+	}
+};
+
+typedef MPM_KERNEL MPMKernel;
+//Grid nodes each particle interpolates to
+static const int MPM_STENCIL = MPMKernel::SIZE*MPMKernel::SIZE*MPMKernel::SIZE;
+//Weights and slopes along each axis, for each particle (see WEIGHTS_SEPARABLE)
+static const int MPM_AXIS_WEIGHTS = 6*MPMKernel::SIZE;
+
+//How particle interpolation weights are stored between steps, like the 2D simulator's
+//WEIGHT_MODE; all three give identical results. MPM_WEIGHTS is the default
+enum WeightMode{
+	WEIGHTS_CACHED,		//All weights and gradients for each particle (2 KB for cubic, in doubles)
+	WEIGHTS_SEPARABLE,	//Weights and slopes along each axis (192 bytes for cubic, in doubles)
+	WEIGHTS_RECOMPUTE	//Nothing; recompute them from the particle's position in each step
+};
+#define MPM_WEIGHTS WEIGHTS_SEPARABLE
+
+//Grid node data
+typedef struct SnowNode{
+	freal mass;
+	bool active;
+	eigen_vector3 velocity, velocity_new,
+		force;		//internal (elastic) force, before dividing by mass
+} SnowNode;
+//Collision and external force inputs, which the solver only reads
+typedef struct SnowNodeInput{
+	freal col_sdf;	//positive inside colliders
+	eigen_vector3 col_velocity, ext_force;
+} SnowNodeInput;
+
+//Nodes per side of a grid block; particles are binned by block, and blocks of the same
+//color are far enough apart that their particles never scatter to the same node, so
+//they can all be scattered in parallel (must be at least MPMKernel::SIZE)
+static const int GRID_BLOCK = 8;
+static const int BLOCK_COLORS = 8;
+
+//Dense grid of interleaved node data, with x varying fastest, then y, then z
+class SnowGrid{
+public:
+	int size[3];
+	//Position of node (0, 0, 0), and distance between nodes
+	eigen_vector3 origin, cellsize;
+	std::vector<SnowNode> nodes;
+	std::vector<SnowNodeInput> inputs;
+
+	//Resizes the grid, leaving the nodes and inputs as they are (SnowCore::resetGrid
+	//clears the nodes too)
+	void resize(const int divisions[3]){
+		for (int i=0; i<3; i++)
+			size[i] = divisions[i];
+		int count = size[0]*size[1]*size[2];
+		nodes.resize(count);
+		inputs.resize(count);
+	}
+	int nodeCount() const{
+		return nodes.size();
+	}
+	bool inside(int axis, int i) const{
+		return i >= 0 && i < size[axis];
+	}
+	bool inside(int x, int y, int z) const{
+		return inside(0, x) && inside(1, y) && inside(2, z);
+	}
+	int index(int x, int y, int z) const{
+		return x + size[0]*(y + size[1]*z);
+	}
+	//Index of the nearest node in the grid; particle stencils that stick out of the
+	//grid give those nodes zero weight, so they can use any node
+	int clampedIndex(int x, int y, int z) const{
+		x = x < 0 ? 0 : (x < size[0] ? x : size[0]-1);
+		y = y < 0 ? 0 : (y < size[1] ? y : size[1]-1);
+		z = z < 0 ? 0 : (z < size[2] ? z : size[2]-1);
+		return index(x, y, z);
+	}
+	//Inputs outside the grid are zero, like the Houdini fields' border
+	const SnowNodeInput& input(int x, int y, int z) const{
+		static const SnowNodeInput outside = {0, eigen_vector3::Zero(), eigen_vector3::Zero()};
+		return inside(x, y, z) ? inputs[index(x, y, z)] : outside;
+	}
+	//Grid coordinates of a position
+	eigen_vector3 gridPosition(const eigen_vector3& position) const{
+		return (position - origin).cwiseQuotient(cellsize);
+	}
+};
+
+//Particles, stored as a structure of arrays
+class SnowParticles{
+public:
+	std::vector<eigen_vector3> position, velocity;
+	std::vector<freal> volume, density;
+	//Elastic and plastic deformation gradients; with scalar_jp set, only the
+	//plastic gradient's determinant is kept (jp), since that's all the solver uses
+	std::vector<eigen_matrix3> def_elastic, def_plastic;
+	std::vector<freal> jp;
+	//Rotation (x, y, z, w) from each particle's last SVD, which the next one starts
+	//from when warm_svd is set (see SVD3.h); unused otherwise
+	std::vector<eigen_vector4> svd_rotation;
+	bool warm_svd, scalar_jp;
+
+	SnowParticles() : warm_svd(false), scalar_jp(false){}
+	int size() const{
+		return position.size();
+	}
+	//Determinant of the plastic deformation gradient
+	freal plasticJ(int pid) const{
+		return scalar_jp ? jp[pid] : def_plastic[pid].determinant();
+	}
+	void resize(int count){
+		position.resize(count);
+		velocity.resize(count);
+		volume.resize(count);
+		density.resize(count);
+		def_elastic.resize(count);
+		def_plastic.resize(scalar_jp ? 0 : count);
+		jp.resize(scalar_jp ? count : 0);
+		svd_rotation.resize(warm_svd ? count : 0);
+	}
+};
+
+//Material and solver parameters (the DOP's parameters of the same names)
+typedef struct SnowParameters{
+	freal particle_mass,
+		youngs_modulus,
+		poissons_ratio,
+		crit_compress,
+		crit_stretch,
+		flip_percent,
+		hardening,
+		cfl,			//fraction of a cell the fastest wave crosses in a substep (see stableTimestep)
+		cof,
+		max_velocity;
+	eigen_vector3 gravity;
+} SnowParameters;
+
+class SnowCore;
+template<int mode> class SnowStencil;
+//One of SnowCore's loops, over particles, grid slices or blocks; does items [begin, end)
+typedef void (SnowCore::*SnowTask)(int begin, int end);
+
+//Runs SnowCore's loops; this one runs them on the calling thread. SIM_SnowSolver
+//runs them on Houdini's threads, and snowcore-bench on its own
+class SnowJobs{
+public:
+	virtual ~SnowJobs(){}
+	//Calls (core->*task)(begin, end) for all items in [0, count), chunk items at a time
+	//(begin is always a multiple of chunk); blocks until they're all done. Chunks can
+	//run in any order, on any thread
+	virtual void run(SnowCore* core, SnowTask task, int count, int /*chunk*/){
+		(core->*task)(0, count);
+	}
+	//Most chunks that can run at once
+	virtual int threads() const{
+		return 1;
+	}
+};
+
+//One substep of the snow simulation, on its own particles and grid
+class SnowCore{
+public:
+	SnowParameters params;
+	SnowParticles particles;
+	SnowGrid grid;
+	//Runs the loops of each step (not owned)
+	SnowJobs* jobs;
+	//How interpolation weights are kept from step #1 to the others; only change it
+	//between substeps
+	WeightMode weight_mode;
+
+	SnowCore();
+
+	//Resizes the grid and clears the nodes; the inputs are up to the caller
+	void resetGrid(const int divisions[3]);
+	//Longest substep the CFL condition allows for the particles as they are: params.cfl
+	//cells, over the fastest particle speed plus elastic wave speed (0 if cfl isn't set)
+	freal stableTimestep();
+	//Steps #1 and #3 to #7, in order; the grid should be reset beforehand, and the
+	//particles' volumes set (see estimateVolumes)
+	void step(freal timestep);
+
+	/// STEP #1: Transfer mass to grid (and compute the interpolation weights)
+	void rasterizeMass();
+	/// STEP #2: First timestep only - Estimate particle volumes using grid mass
+	void estimateVolumes();
+	/// STEP #3: Transfer velocity to grid
+	void transferVelocities();
+	/// STEP #4: Compute new grid velocities; plasticity and internal forces first,
+	/// then the velocity update
+	void computeForces();
+	void updateVelocities(freal timestep);
+	/// STEP #5: Grid collision resolution
+	void collideGrid();
+	/// STEP #6: Transfer grid velocities to particles and integrate
+	/// STEP #7: Particle collision resolution
+	void updateParticles(freal timestep);
+
+private:
+	template<int mode> friend class SnowStencil;
+	//Interpolation weights and their gradients, MPM_STENCIL for each particle
+	//(WEIGHTS_CACHED), or weights and slopes along each axis, MPM_AXIS_WEIGHTS for each
+	//particle (WEIGHTS_SEPARABLE); kept between substeps, so they're only allocated once
+	std::vector<freal> weights, axis_weights;
+	std::vector<eigen_vector3> weight_gradients;
+	//Each particle's stress (the energy derivative, times volume), from computeForces
+	std::vector<eigen_matrix3> stress;
+	//Fastest particle (plus wave) speed in each chunk of particles, for stableTimestep
+	std::vector<freal> chunk_speeds;
+
+	//Particles binned by grid block (the block of the first node they touch)
+	int blocks[3];
+	std::vector<int> particle_block, block_start, block_particles;
+	//Counts, then write offsets, of each range of particles in each block
+	std::vector<int> bin_offsets;
+	int bin_ranges;
+	//Blocks of each color, and the color being scattered
+	std::vector<int> color_blocks[BLOCK_COLORS];
+	int scatter_color;
+
+	void binParticles();
+	void findBlocks(int begin, int end);
+	void countBins(int begin, int end);
+	void placeBins(int begin, int end);
+	//Runs a particle kernel on every particle, a color of blocks at a time
+	template<void (SnowCore::*kernel)(int)> void scatter();
+	template<void (SnowCore::*kernel)(int)> void scatterBlocks(int begin, int end);
+
+	//Weights and slopes of a particle's stencil along each axis (MPM_AXIS_WEIGHTS)
+	void axisWeights(const eigen_vector3& gpos, freal* axis) const;
+	//Per particle kernels; those templated on the weight mode are dispatched using weight_mode
+	template<int mode> void rasterizeParticle(int pid);
+	template<int mode> void transferParticle(int pid);
+	template<int mode> void forceParticle(int pid);
+	//Tasks over particles
+	template<int mode> void estimateVolumesTask(int begin, int end);
+	void plasticityTask(int begin, int end);
+	template<int mode> void updateParticlesTask(int begin, int end);
+	void waveSpeedTask(int begin, int end);
+	//Tasks over z slices of the grid
+	void clearSlices(int begin, int end);
+	void normalizeSlices(int begin, int end);
+	void updateSlices(int begin, int end);
+	void collideSlices(int begin, int end);
+
+	//Timestep of the step in progress, for the tasks
+	freal step_timestep;
+
+	bool computeSDFNormal(int x, int y, int z, eigen_vector3 &norm) const;
+};
+
+#endif
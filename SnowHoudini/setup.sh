@@ -10,7 +10,10 @@ pushd ${HFS}
 source ./houdini_setup
 popd
 
+#the solver itself doesn't depend on houdini (see the Makefile)
+make build/libsnowcore.a || exit 1
+
 #compile each houdini node
 #hcustom SIM_CalculateVelocity.C
 #hcustom SIM_GridInterpolate.c
-hcustom SIM_SnowSolver.c
+hcustom -I. -Lbuild -lsnowcore SIM_SnowSolver.c
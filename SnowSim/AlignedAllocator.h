@@ -0,0 +1,63 @@
+#ifndef ALIGNEDALLOCATOR_H
+#define	ALIGNEDALLOCATOR_H
+
+#include <stdlib.h>
+#include <new>
+
+//Cache line size; arrays start on a cache line so SIMD loads are aligned
+#define CACHE_LINE 64
+
+//STL allocator that aligns storage to a cache line
+template<class T>
+class AlignedAllocator {
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	template<class U> struct rebind{
+		typedef AlignedAllocator<U> other;
+	};
+
+	AlignedAllocator(){}
+	AlignedAllocator(const AlignedAllocator&){}
+	template<class U> AlignedAllocator(const AlignedAllocator<U>&){}
+	~AlignedAllocator(){}
+
+	pointer address(reference x) const{
+		return &x;
+	}
+	const_pointer address(const_reference x) const{
+		return &x;
+	}
+	pointer allocate(size_type n, const void* /*hint*/ = 0){
+		void* mem;
+		if (posix_memalign(&mem, CACHE_LINE, n*sizeof(T)))
+			throw std::bad_alloc();
+		return (pointer) mem;
+	}
+	void deallocate(pointer p, size_type /*n*/){
+		free(p);
+	}
+	size_type max_size() const{
+		return ((size_type) -1)/sizeof(T);
+	}
+	void construct(pointer p, const T& val){
+		new ((void*) p) T(val);
+	}
+	void destroy(pointer p){
+		p->~T();
+	}
+	
+	bool operator==(const AlignedAllocator&) const{
+		return true;
+	}
+	bool operator!=(const AlignedAllocator&) const{
+		return false;
+	}
+};
+
+#endif
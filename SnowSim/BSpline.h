@@ -0,0 +1,96 @@
+#ifndef BSPLINE_H
+#define	BSPLINE_H
+
+#include <math.h>
+#include "SimConstants.h"
+
+const float BSPLINE_EPSILON = 1e-4;
+
+//Grid interpolation kernels; BSPLINE_KERNEL (SimConstants.h) picks which one the
+//simulation uses. Positions are given in grid units. Each kernel provides:
+//	SIZE			number of nodes along each axis that a particle interpolates to
+//	first(x)		index of the first of those nodes, for a particle at grid position x
+//	radius()		how far a particle can reach, in cells; also used for the collision border
+//	invInertia()	inverse of the APIC/MLS inertia tensor, times h^2
+//	weight(x)		interpolation weight for a node x cells away
+//	slope(x)		derivative of weight(x)
+
+//Cubic B-spline shape/basis/interpolation function
+//A smooth curve from (0,1) to (1,0)
+class CubicBSpline{
+public:
+	enum{ SIZE = 4 };
+
+	static int first(float x){
+		return (int) x - 1;
+	}
+	static float radius(){
+		return 2;
+	}
+	static float invInertia(){
+		return 3;
+	}
+	static float weight(float x){
+		x = fabs(x);
+		float w;
+		if (x < 1)
+			w = x*x*(x/2 - 1) + 2/3.0;
+		else if (x < 2)
+			w = x*(x*(-x/6 + 1) - 2) + 4/3.0;
+		else return 0;
+		//Clamp between 0 and 1... if needed
+		if (w < BSPLINE_EPSILON) return 0;
+		return w;
+	}
+	static float slope(float x){
+		float abs_x = fabs(x);
+		if (abs_x < 1)
+			return 1.5*x*abs_x - 2*x;
+		else if (x < 2)
+			return -x*abs_x/2 + 2*x - 2*x/abs_x;
+		else return 0;
+		//Clamp between -2/3 and 2/3... if needed
+	}
+};
+
+//Quadratic B-spline; only touches 3 nodes per axis instead of 4, but
+//is not as smooth (the slope is only piecewise linear)
+class QuadraticBSpline{
+public:
+	enum{ SIZE = 3 };
+
+	static int first(float x){
+		return (int) (x - .5f);
+	}
+	static float radius(){
+		return 1.5;
+	}
+	static float invInertia(){
+		return 4;
+	}
+	static float weight(float x){
+		x = fabs(x);
+		float w;
+		if (x < .5)
+			w = .75 - x*x;
+		else if (x < 1.5){
+			w = 1.5 - x;
+			w *= w/2;
+		}
+		else return 0;
+		if (w < BSPLINE_EPSILON) return 0;
+		return w;
+	}
+	static float slope(float x){
+		float abs_x = fabs(x);
+		if (abs_x < .5)
+			return -2*x;
+		else if (abs_x < 1.5)
+			return x < 0 ? x + 1.5 : x - 1.5;
+		else return 0;
+	}
+};
+
+typedef BSPLINE_KERNEL GridKernel;
+
+#endif
@@ -1,4 +1,91 @@
 #include "Grid.h"
+#if ENABLE_IMPLICIT
+#include "../SnowHoudini/Eigen/Sparse"
+#endif
+
+//Interpolation weights and gradients of a particle's stencil, indexed by
+//(GridKernel::SIZE*y + x); depending on the weight mode, they are read from the particle
+//or computed from its separable weights
+template<int mode> class Stencil{
+public:
+	Stencil(const Grid* grid, int i){
+		cellsize[0] = grid->cellsize.data[0];
+		cellsize[1] = grid->cellsize.data[1];
+		if (mode == WEIGHTS_SEPARABLE)
+			axis = &grid->obj->axis_weights[i*PARTICLE_AXIS_WEIGHTS];
+		else{
+			Grid::axisWeights(grid->obj->grid_position[i], axis_data);
+			axis = axis_data;
+		}
+	}
+	
+	float weight(int idx) const{
+		return axis[idx % n]*axis[n + idx/n];
+	}
+	const Vector2f gradient(int idx) const{
+		int x = idx % n, y = idx / n;
+		//I don't know why we need to divide by cellsize... JT did it, doesn't appear in tech paper
+		return Vector2f(axis[2*n+x]*axis[n+y]/cellsize[0], axis[x]*axis[3*n+y]/cellsize[1]);
+	}
+	
+private:
+	enum{ n = GridKernel::SIZE };
+	float cellsize[2];
+	const float* axis;
+	float axis_data[PARTICLE_AXIS_WEIGHTS];
+};
+template<> class Stencil<WEIGHTS_CACHED>{
+public:
+	Stencil(const Grid* grid, int i) :
+		weights(&grid->obj->weights[i*PARTICLE_STENCIL]),
+		weight_gradient(&grid->obj->weight_gradient[i*PARTICLE_STENCIL]){}
+	
+	float weight(int idx) const{
+		return weights[idx];
+	}
+	const Vector2f& gradient(int idx) const{
+		return weight_gradient[idx];
+	}
+	
+private:
+	const float* weights;
+	const Vector2f* weight_gradient;
+};
+
+//Stencil weights and gradients as flat arrays, for the vectorised kernels; cached
+//weights are used in place, the others are filled in from the separable weights
+template<int mode> class SimdStencil{
+public:
+	const float* weights;
+	const Vector2f* gradients;
+	
+	SimdStencil(const Grid* grid, const SimdKernels* simd, int i, bool need_gradients){
+		const float* axis;
+		if (mode == WEIGHTS_SEPARABLE)
+			axis = &grid->obj->axis_weights[i*PARTICLE_AXIS_WEIGHTS];
+		else{
+			simd->axisWeights(grid->obj->grid_position[i], axis_data);
+			axis = axis_data;
+		}
+		simd->stencilWeights(axis, grid->cellsize, weight_data, need_gradients ? gradient_data : NULL);
+		weights = weight_data;
+		gradients = gradient_data;
+	}
+	
+private:
+	float axis_data[SIMD_STENCIL] __attribute__((aligned(CACHE_LINE)));
+	float weight_data[SIMD_STENCIL] __attribute__((aligned(CACHE_LINE)));
+	Vector2f gradient_data[SIMD_STENCIL];
+};
+template<> class SimdStencil<WEIGHTS_CACHED>{
+public:
+	const float* weights;
+	const Vector2f* gradients;
+	
+	SimdStencil(const Grid* grid, const SimdKernels* /*simd*/, int i, bool need_gradients) :
+		weights(&grid->obj->weights[i*PARTICLE_STENCIL]),
+		gradients(need_gradients ? &grid->obj->weight_gradient[i*PARTICLE_STENCIL] : NULL){}
+};
 
 Grid::Grid(Vector2f pos, Vector2f dims, Vector2f cells, PointCloud* object){
 	obj = object;
@@ -6,138 +93,475 @@ Grid::Grid(Vector2f pos, Vector2f dims, Vector2f cells, PointCloud* object){
 	cellsize = dims/cells;
 	size = cells+1;
 	nodes_length = size.product();
+	weight_mode = WEIGHT_MODE;
+	transfer_mode = TRANSFER_MODE;
+	sort_mode = SORT_MODE;
+	sort_interval = SORT_INTERVAL;
+	steps_since_sort = 0;
+	simd_level = SIMD_LEVEL;
+	simd = NULL;
 	nodes = new GridNode[nodes_length];
 	node_area = cellsize.product();
+	
+	//Split grid into blocks, and color them in a checkerboard pattern (four colors)
+	blocks_x = ((int) size[0] + GRID_BLOCK-1)/GRID_BLOCK;
+	blocks_y = ((int) size[1] + GRID_BLOCK-1)/GRID_BLOCK;
+	for (int by=0, b=0; by<blocks_y; by++){
+		for (int bx=0; bx<blocks_x; bx++, b++)
+			color_blocks[(bx & 1) + 2*(by & 1)].push_back(b);
+	}
+	block_start.resize(blocks_x*blocks_y+1);
+	block_occupied.resize(blocks_x*blocks_y);
+	//Only active blocks get cleared each step, so start with an empty grid
+	std::fill(nodes, nodes+nodes_length, GridNode());
+#if ENABLE_IMPLICIT
+	implicit_solver = IMPLICIT_SOLVER;
+	implicit_preconditioner = IMPLICIT_PRECONDITIONER;
+	implicit_iterations = 0;
+	implicit_integrator = IMPLICIT_INTEGRATOR;
+	newton_iterations = 0;
+	implicit_guess.resize(nodes_length);
+	block_solved.assign(blocks_x*blocks_y, 0);
+#endif
 }
 Grid::Grid(const Grid& orig){}
 Grid::~Grid(){
 	delete[] nodes;
 }
 
-//Maps mass and velocity to the grid
+//Particles are created in random order, and spread out as the snow breaks apart,
+//so particles next to each other in memory rarely share grid nodes; sorting them by
+//grid cell means the transfers reuse the same nodes (and cache lines) from one particle
+//to the next. Z-order keeps each grid block's particles together, too.
+void Grid::sortParticles(){
+	if (sort_mode == SORT_NONE || sort_interval <= 0 || steps_since_sort++ % sort_interval)
+		return;
+	int n = obj->size;
+	sort_keys.resize(n);
+	ThreadPool::shared()->run<Grid, &Grid::computeSortKeys>(this, n);
+	if (sort_mode == SORT_FULL)
+		std::sort(sort_keys.begin(), sort_keys.end());
+	else{
+		//Particles move less than a cell per step, so most of them are still in
+		//order; pull out the ones that aren't, sort those, and merge them back in.
+		//Anything out of order with either neighbor gets pulled out, which can
+		//include a few that didn't need to be, but the ones left are still sorted
+		sort_moved.clear();
+		int kept = 0;
+		for (int i=0; i<n; i++){
+			unsigned long long key = sort_keys[i];
+			if ((kept == 0 || key >= sort_keys[kept-1]) && (i+1 == n || key <= sort_keys[i+1]))
+				sort_keys[kept++] = key;
+			else sort_moved.push_back(key);
+		}
+		std::sort(sort_moved.begin(), sort_moved.end());
+		std::copy(sort_moved.begin(), sort_moved.end(), sort_keys.begin()+kept);
+		std::inplace_merge(sort_keys.begin(), sort_keys.begin()+kept, sort_keys.end());
+	}
+	//Only the range of particles that changed places needs to be moved
+	int first = 0, last = n;
+	while (first < last && (int) (sort_keys[first] & 0xffffffff) == first)
+		first++;
+	while (last > first && (int) (sort_keys[last-1] & 0xffffffff) == last-1)
+		last--;
+	if (first == last)
+		return;
+	sort_order.resize(last-first);
+	for (int i=first; i<last; i++)
+		sort_order[i-first] = sort_keys[i] & 0xffffffff;
+	obj->reorder(&sort_order[0], first, last);
+}
+//Spreads the low 16 bits of x out to the even bits, for Z-order indices
+static inline unsigned int spreadBits(unsigned int x){
+	x &= 0xffff;
+	x = (x | (x << 8)) & 0x00ff00ff;
+	x = (x | (x << 4)) & 0x0f0f0f0f;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+void Grid::computeSortKeys(int begin, int end, int /*thread*/){
+	for (int i=begin; i<end; i++){
+		Vector2f cell = (obj->position[i] - origin)/cellsize;
+		unsigned long long key = spreadBits((int) cell[0]) | (spreadBits((int) cell[1]) << 1);
+		//Ties are broken by the current index, so the sort is stable
+		sort_keys[i] = key << 32 | i;
+	}
+}
+
+//Maps mass to the grid; only needed by calculateVolumes
 void Grid::initializeMass(){
+	prepareGrid();
+	switch (weight_mode){
+		case WEIGHTS_CACHED: scatter<&Grid::scatterMass<WEIGHTS_CACHED> >(); break;
+		case WEIGHTS_SEPARABLE: scatter<&Grid::scatterMass<WEIGHTS_SEPARABLE> >(); break;
+		case WEIGHTS_RECOMPUTE: scatter<&Grid::scatterMass<WEIGHTS_RECOMPUTE> >(); break;
+	}
+}
+//Maps mass, velocity and internal forces to the grid
+void Grid::initializeGrid(){
+	prepareGrid();
+	//All the particle data is scattered in one pass, so each
+	//particle's weights and grid nodes are only read once
+	if (transfer_mode == TRANSFER_MLS){
+		switch (weight_mode){
+			case WEIGHTS_CACHED: scatter<&Grid::scatterAffine<WEIGHTS_CACHED> >(); break;
+			case WEIGHTS_SEPARABLE: scatter<&Grid::scatterAffine<WEIGHTS_SEPARABLE> >(); break;
+			case WEIGHTS_RECOMPUTE: scatter<&Grid::scatterAffine<WEIGHTS_RECOMPUTE> >(); break;
+		}
+	}
+	else switch (weight_mode){
+		case WEIGHTS_CACHED: scatter<&Grid::scatterParticle<WEIGHTS_CACHED> >(); break;
+		case WEIGHTS_SEPARABLE: scatter<&Grid::scatterParticle<WEIGHTS_SEPARABLE> >(); break;
+		case WEIGHTS_RECOMPUTE: scatter<&Grid::scatterParticle<WEIGHTS_RECOMPUTE> >(); break;
+	}
+}
+void Grid::prepareGrid(){
 	//Reset the grid
-	//If the grid is sparsely filled, it may be better to reset individual nodes
-	//Also, not all these variables need to be zeroed, so... yeah
-	memset(nodes, 0, sizeof(GridNode)*nodes_length);
+	//Particles only write to nodes in the active blocks, so those are the only
+	//ones we need to clear; not all these variables need to be zeroed, but
+	//it is simpler this way
+	ThreadPool* pool = ThreadPool::shared();
+	pool->run<Grid, &Grid::clearBlocks>(this, active_blocks.size());
+	//The vectorised stencil kernels only handle a 4x4 stencil; the
+	//particles' plasticity kernel doesn't care
+	simd = PARTICLE_STENCIL == SIMD_STENCIL ? simdKernels(simd_level) : NULL;
+	obj->simd = simdKernels(simd_level);
 	
-	//Map particle data to grid
-	for (int i=0; i<obj->size; i++){
-		Particle& p = obj->particles[i];
+	//Compute interpolation weights for each particle
+	particle_block.resize(obj->size);
+	switch (weight_mode){
+		case WEIGHTS_CACHED:
+			obj->weights.resize(obj->size*PARTICLE_STENCIL);
+			//MLS transfers don't use weight gradients
+			obj->weight_gradient.resize(transfer_mode == TRANSFER_FLIP ? obj->size*PARTICLE_STENCIL : 0);
+			pool->run<Grid, &Grid::computeWeights<WEIGHTS_CACHED> >(this, obj->size);
+			break;
+		case WEIGHTS_SEPARABLE:
+			obj->axis_weights.resize(obj->size*PARTICLE_AXIS_WEIGHTS);
+			pool->run<Grid, &Grid::computeWeights<WEIGHTS_SEPARABLE> >(this, obj->size);
+			break;
+		case WEIGHTS_RECOMPUTE:
+			pool->run<Grid, &Grid::computeWeights<WEIGHTS_RECOMPUTE> >(this, obj->size);
+			break;
+	}
+	//Sort particles into blocks, so we can scatter to the grid in parallel
+	if (pool->size() > 1)
+		binParticles();
+	findActiveBlocks();
+}
+void Grid::clearBlocks(int begin, int end, int /*thread*/){
+	//GridNode isn't trivially copyable (Vector2f has constructors), so no memset
+	const GridNode empty = GridNode();
+	for (int b=begin; b<end; b++){
+		int x_start, x_end, y_start, y_end;
+		blockNodes(active_blocks[b], x_start, x_end, y_start, y_end);
+		for (int y=y_start; y<y_end; y++){
+			GridNode* row = &nodes[(int) (y*size[0]+x_start)];
+			std::fill(row, row+(x_end-x_start), empty);
+		}
+	}
+}
+void Grid::findActiveBlocks(){
+	int num_blocks = blocks_x*blocks_y;
+	//Find which blocks have particles in them
+	if (ThreadPool::shared()->size() > 1){
+		//Particles have been binned already
+		for (int b=0; b<num_blocks; b++)
+			block_occupied[b] = block_start[b+1] > block_start[b];
+	}
+	else{
+		memset(&block_occupied[0], 0, num_blocks);
+		for (int i=0; i<obj->size; i++)
+			block_occupied[particle_block[i]] = 1;
+	}
+	//A particle's stencil can spill over into the neighboring blocks,
+	//so a block is active if it or any of its neighbors are occupied
+	active_blocks.clear();
+	for (int by=0, b=0; by<blocks_y; by++){
+		int y_start = by > 0 ? by-1 : 0,
+			y_end = by+1 < blocks_y ? by+1 : by;
+		for (int bx=0; bx<blocks_x; bx++, b++){
+			int x_start = bx > 0 ? bx-1 : 0,
+				x_end = bx+1 < blocks_x ? bx+1 : bx;
+			bool active = false;
+			for (int y=y_start; y<=y_end && !active; y++){
+				for (int x=x_start; x<=x_end; x++){
+					if (block_occupied[y*blocks_x+x]){
+						active = true;
+						break;
+					}
+				}
+			}
+			if (active)
+				active_blocks.push_back(b);
+		}
+	}
+}
+template<int mode>
+void Grid::computeWeights(int begin, int end, int /*thread*/){
+	for (int i=begin; i<end; i++){
+		Vector2f& grid_position = obj->grid_position[i];
 		//Particle position to grid coordinates
 		//This will give errors if the particle is outside the grid bounds
-		p.grid_position = (p.position - origin)/cellsize;
-		float ox = p.grid_position[0], oy = p.grid_position[1];
-		
+		grid_position = (obj->position[i] - origin)/cellsize;
+		particle_block[i] = ((int) grid_position[1]/GRID_BLOCK)*blocks_x + (int) grid_position[0]/GRID_BLOCK;
 		
-		//Shape function gives a blending radius of two;
-		//so we do computations within a 2x2 square for each particle
-		for (int idx=0, y=oy-1, y_end=y+3; y<=y_end; y++){
-			//Y-dimension interpolation
-			float y_pos = oy-y,
-				wy = Grid::bspline(y_pos),
-				dy = Grid::bsplineSlope(y_pos);
-			
-			for (int x=ox-1, x_end=x+3; x<=x_end; x++, idx++){
-				//X-dimension interpolation
-				float x_pos = ox-x,
-					wx = Grid::bspline(x_pos),
-					dx = Grid::bsplineSlope(x_pos);
-				
-				//Final weight is dyadic product of weights in each dimension
-				float weight = wx*wy;
-				p.weights[idx] = weight;
-				
-				//Weight gradient is a vector of partial derivatives
-				p.weight_gradient[idx].setData(dx*wy, wx*dy);				
-				//I don't know why we need to do this... JT did it, doesn't appear in tech paper
-				p.weight_gradient[idx] /= cellsize;
-				
-				//Interpolate mass
-				nodes[(int) (y*size[0]+x)].mass += weight*p.mass;
+		//Each particle interpolates to a GridKernel::SIZE square of nodes
+		if (simd != NULL){
+			if (mode == WEIGHTS_SEPARABLE)
+				simd->axisWeights(grid_position, &obj->axis_weights[i*PARTICLE_AXIS_WEIGHTS]);
+			else if (mode == WEIGHTS_CACHED){
+				float axis[SIMD_STENCIL];
+				simd->axisWeights(grid_position, axis);
+				simd->stencilWeights(axis, cellsize, &obj->weights[i*PARTICLE_STENCIL],
+					transfer_mode == TRANSFER_FLIP ? &obj->weight_gradient[i*PARTICLE_STENCIL] : NULL);
+			}
+		}
+		else if (mode == WEIGHTS_SEPARABLE)
+			axisWeights(grid_position, &obj->axis_weights[i*PARTICLE_AXIS_WEIGHTS]);
+		else if (mode == WEIGHTS_CACHED){
+			//Final weight is dyadic product of weights in each dimension
+			Stencil<WEIGHTS_RECOMPUTE> stencil(this, i);
+			float* weights = &obj->weights[i*PARTICLE_STENCIL];
+			for (int idx=0; idx<PARTICLE_STENCIL; idx++)
+				weights[idx] = stencil.weight(idx);
+			if (transfer_mode == TRANSFER_FLIP){
+				Vector2f* weight_gradient = &obj->weight_gradient[i*PARTICLE_STENCIL];
+				for (int idx=0; idx<PARTICLE_STENCIL; idx++)
+					weight_gradient[idx] = stencil.gradient(idx);
 			}
 		}
 	}
 }
-void Grid::initializeVelocities(){
-	//We interpolate velocity after mass, to conserve momentum
-	for (int i=0; i<obj->size; i++){
-		Particle& p = obj->particles[i];
-		int ox = p.grid_position[0],
-			oy = p.grid_position[1];
-		for (int idx=0, y=oy-1, y_end=y+3; y<=y_end; y++){
-			for (int x=ox-1, x_end=x+3; x<=x_end; x++, idx++){
-				float w = p.weights[idx];
-				if (w > BSPLINE_EPSILON){
-					//Interpolate velocity
-					int n = (int) (y*size[0]+x);
-					//We could also do a separate loop to divide by nodes[n].mass only once
-					nodes[n].velocity += p.velocity * w * p.mass;
-					nodes[n].active = true;
-				}
+template<int mode>
+void Grid::scatterMass(int i){
+	float mass = obj->mass[i];
+	int ox = GridKernel::first(obj->grid_position[i][0]),
+		oy = GridKernel::first(obj->grid_position[i][1]);
+	if (simd != NULL){
+		SimdStencil<mode> stencil(this, simd, i, false);
+		simd->scatterMass(&nodes[(int) (oy*size[0]+ox)], size[0], stencil.weights, mass);
+		return;
+	}
+	Stencil<mode> stencil(this, i);
+	for (int idx=0, y=oy, y_end=y+GridKernel::SIZE; y<y_end; y++){
+		for (int x=ox, x_end=x+GridKernel::SIZE; x<x_end; x++, idx++){
+			//Interpolate mass
+			nodes[(int) (y*size[0]+x)].mass += stencil.weight(idx)*mass;
+		}
+	}
+}
+template<int mode>
+void Grid::scatterParticle(int i){
+	Vector2f velocity = obj->velocity[i];
+	float mass = obj->mass[i];
+	//Solve for grid internal forces
+	Matrix2f energy = obj->energyDerivative(i);
+	int ox = GridKernel::first(obj->grid_position[i][0]),
+		oy = GridKernel::first(obj->grid_position[i][1]);
+	if (simd != NULL){
+		SimdStencil<mode> stencil(this, simd, i, true);
+		simd->scatterParticle(&nodes[(int) (oy*size[0]+ox)], size[0], stencil.weights, stencil.gradients, mass, velocity, energy);
+		return;
+	}
+	Stencil<mode> stencil(this, i);
+	for (int idx=0, y=oy, y_end=y+GridKernel::SIZE; y<y_end; y++){
+		for (int x=ox, x_end=x+GridKernel::SIZE; x<x_end; x++, idx++){
+			float w = stencil.weight(idx);
+			GridNode& node = nodes[(int) (y*size[0]+x)];
+			//Interpolate mass
+			node.mass += w*mass;
+			if (w > BSPLINE_EPSILON){
+				//Interpolate momentum; we divide by mass later, once per node
+				node.velocity += velocity * w * mass;
+				node.active = true;
+				//Weight the force onto nodes
+				//We store force in velocity_new, since we're not using that variable at the moment
+				node.velocity_new += energy*stencil.gradient(idx);
 			}
 		}
 	}
-	for (int i=0; i<nodes_length; i++){
-		GridNode &node = nodes[i];
-		if (node.active)
-			node.velocity /= node.mass;
+}
+//MLS-MPM version of scatterParticle; the affine velocity (APIC) and stress
+//force are combined into one matrix, so we only scatter momentum
+template<int mode>
+void Grid::scatterAffine(int i){
+	float mass = obj->mass[i];
+	Vector2f momentum = obj->velocity[i]*mass;
+	//Momentum from the affine velocity field is mass*C*(x_i - x_p); offsets are
+	//in grid units, so we scale by the cellsize to get world units
+	Matrix2f affine = obj->velocity_gradient[i]*mass;
+	affine.diag_product(cellsize);
+	//Stress force is approximated by -dt*V*P*F^T*D^-1*(x_i - x_p)
+	Matrix2f stress = obj->energyDerivative(i)*(-TIMESTEP*GridKernel::invInertia());
+	stress.diag_product_inv(cellsize);
+	affine += stress;
+	float gx = obj->grid_position[i][0],
+		gy = obj->grid_position[i][1];
+	int ox = GridKernel::first(gx), oy = GridKernel::first(gy);
+	if (simd != NULL){
+		SimdStencil<mode> stencil(this, simd, i, false);
+		simd->scatterAffine(&nodes[(int) (oy*size[0]+ox)], size[0], stencil.weights, obj->grid_position[i], mass, momentum, affine);
+		return;
+	}
+	Stencil<mode> stencil(this, i);
+	for (int idx=0, y=oy, y_end=y+GridKernel::SIZE; y<y_end; y++){
+		for (int x=ox, x_end=x+GridKernel::SIZE; x<x_end; x++, idx++){
+			float w = stencil.weight(idx);
+			GridNode& node = nodes[(int) (y*size[0]+x)];
+			node.mass += w*mass;
+			if (w > BSPLINE_EPSILON){
+				node.velocity += (momentum + affine*Vector2f(x-gx, y-gy))*w;
+				node.active = true;
+			}
+		}
 	}
-	collisionGrid();
 }
+
 //Maps volume from the grid to particles
 //This should only be called once, at the beginning of the simulation
 void Grid::calculateVolumes() const{
+	ThreadPool* pool = ThreadPool::shared();
+	switch (weight_mode){
+		case WEIGHTS_CACHED: pool->run<Grid, &Grid::calculateVolumes<WEIGHTS_CACHED> >(this, obj->size); break;
+		case WEIGHTS_SEPARABLE: pool->run<Grid, &Grid::calculateVolumes<WEIGHTS_SEPARABLE> >(this, obj->size); break;
+		case WEIGHTS_RECOMPUTE: pool->run<Grid, &Grid::calculateVolumes<WEIGHTS_RECOMPUTE> >(this, obj->size); break;
+	}
+}
+template<int mode>
+void Grid::calculateVolumes(int begin, int end, int /*thread*/) const{
 	//Estimate each particles volume (for force calculations)
-	for (int i=0; i<obj->size; i++){
-		Particle& p = obj->particles[i];
-		int ox = p.grid_position[0],
-			oy = p.grid_position[1];
+	for (int i=begin; i<end; i++){
+		Stencil<mode> stencil(this, i);
+		float& density = obj->density[i];
+		int ox = GridKernel::first(obj->grid_position[i][0]),
+			oy = GridKernel::first(obj->grid_position[i][1]);
 		//First compute particle density
-		p.density = 0;
-		for (int idx=0, y=oy-1, y_end=y+3; y<=y_end; y++){
-			for (int x=ox-1, x_end=x+3; x<=x_end; x++, idx++){
-				float w = p.weights[idx];
+		density = 0;
+		for (int idx=0, y=oy, y_end=y+GridKernel::SIZE; y<y_end; y++){
+			for (int x=ox, x_end=x+GridKernel::SIZE; x<x_end; x++, idx++){
+				float w = stencil.weight(idx);
 				if (w > BSPLINE_EPSILON){
 					//Node density is trivial
-					p.density += w * nodes[(int) (y*size[0]+x)].mass;
+					density += w * nodes[(int) (y*size[0]+x)].mass;
 				}
 			}
 		}
-		p.density /= node_area;
+		density /= node_area;
 		//Volume for each particle can be found from density
-		p.volume = p.mass / p.density;
+		obj->volume[i] = obj->mass[i] / density;
 	}
 }
 //Calculate next timestep velocities for use in implicit integration
 void Grid::explicitVelocities(const Vector2f& gravity){
-	//First, compute the forces
-	//We store force in velocity_new, since we're not using that variable at the moment
-	for (int i=0; i<obj->size; i++){
-		Particle& p = obj->particles[i];
-		//Solve for grid internal forces
-		Matrix2f energy = p.energyDerivative();
-		int ox = p.grid_position[0],
-			oy = p.grid_position[1];
-		for (int idx=0, y=oy-1, y_end=y+3; y<=y_end; y++){
-			for (int x=ox-1, x_end=x+3; x<=x_end; x++, idx++){
-				float w = p.weights[idx];
-				if (w > BSPLINE_EPSILON){
-					//Weight the force onto nodes
-					int n = (int) (y*size[0]+x);
-					nodes[n].velocity_new += energy*p.weight_gradient[idx];
-				}
-			}
+	//Grid forces were computed in initializeGrid; so we can normalize
+	//velocities and integrate in a single pass over the nodes
+	this->gravity = gravity;
+	if (transfer_mode == TRANSFER_MLS)
+		updateNodes<&Grid::affineNode>();
+	else updateNodes<&Grid::explicitNode>();
+}
+void Grid::explicitNode(int idx, int x, int y){
+	GridNode &node = nodes[idx];
+	if (node.active){
+		//Divide by mass only once per node, rather than once per particle
+		node.velocity /= node.mass;
+		//Compute velocities (euler integration)
+		node.velocity_new = node.velocity + TIMESTEP*(gravity - node.velocity_new/node.mass);
+		collisionNode(idx, x, y);
+	}
+}
+void Grid::affineNode(int idx, int x, int y){
+	GridNode &node = nodes[idx];
+	if (node.active){
+		//Stress forces are already part of the momentum
+		node.velocity /= node.mass;
+		node.velocity_new = node.velocity + TIMESTEP*gravity;
+		collisionNode(idx, x, y);
+	}
+}
+
+//Update each node in the active blocks, using the given kernel
+template<void (Grid::*kernel)(int, int, int)>
+void Grid::updateNodes(){
+	ThreadPool::shared()->run<Grid, &Grid::updateBlocks<kernel> >(this, active_blocks.size());
+}
+template<void (Grid::*kernel)(int, int, int)>
+void Grid::updateBlocks(int begin, int end, int /*thread*/){
+	for (int b=begin; b<end; b++){
+		int x_start, x_end, y_start, y_end;
+		blockNodes(active_blocks[b], x_start, x_end, y_start, y_end);
+		for (int y=y_start; y<y_end; y++){
+			for (int x=x_start, idx=y*size[0]+x_start; x<x_end; x++, idx++)
+				(this->*kernel)(idx, x, y);
 		}
 	}
-	
-	//Now we have all grid forces, compute velocities (euler integration)
-	for (int i=0; i<nodes_length; i++){
-		GridNode &node = nodes[i];
-		if (node.active)
-			node.velocity_new = node.velocity + TIMESTEP*(gravity - node.velocity_new/node.mass);
+}
+
+//Scatter each particle to the grid, using the given kernel
+template<void (Grid::*kernel)(int)>
+void Grid::scatter(){
+	ThreadPool* pool = ThreadPool::shared();
+	if (pool->size() == 1){
+		for (int i=0; i<obj->size; i++)
+			(this->*kernel)(i);
+		return;
+	}
+	//Blocks of the same color never scatter to the same node,
+	//so we can do one color at a time without any locking
+	for (scatter_color=0; scatter_color<BLOCK_COLORS; scatter_color++)
+		pool->run<Grid, &Grid::scatterBlocks<kernel> >(this, color_blocks[scatter_color].size(), 1);
+}
+template<void (Grid::*kernel)(int)>
+void Grid::scatterBlocks(int begin, int end, int /*thread*/){
+	const std::vector<int>& blocks = color_blocks[scatter_color];
+	for (int b=begin; b<end; b++){
+		int block = blocks[b];
+		for (int j=block_start[block], j_end=block_start[block+1]; j<j_end; j++)
+			(this->*kernel)(block_particles[j]);
+	}
+}
+
+//Counting sort of particles by block; each thread sorts a contiguous
+//range of particles, so the final order doesn't depend on timing
+void Grid::binParticles(){
+	ThreadPool* pool = ThreadPool::shared();
+	int threads = pool->size(),
+		num_blocks = blocks_x*blocks_y;
+	bin_offsets.assign(threads*num_blocks, 0);
+	block_particles.resize(obj->size);
+	pool->run<Grid, &Grid::countBins>(this, threads, 1);
+	//Prefix sum gives where each thread starts writing in each block
+	for (int b=0, offset=0; b<num_blocks; b++){
+		block_start[b] = offset;
+		for (int t=0; t<threads; t++){
+			int& count = bin_offsets[t*num_blocks+b];
+			int temp = count;
+			count = offset;
+			offset += temp;
+		}
+	}
+	block_start[num_blocks] = obj->size;
+	pool->run<Grid, &Grid::placeBins>(this, threads, 1);
+}
+void Grid::countBins(int begin, int end, int /*thread*/){
+	int threads = ThreadPool::shared()->size(),
+		num_blocks = blocks_x*blocks_y;
+	for (int t=begin; t<end; t++){
+		int* counts = &bin_offsets[t*num_blocks];
+		for (int i=obj->size*(long) t/threads, i_end=obj->size*(long) (t+1)/threads; i<i_end; i++)
+			counts[particle_block[i]]++;
+	}
+}
+void Grid::placeBins(int begin, int end, int /*thread*/){
+	int threads = ThreadPool::shared()->size(),
+		num_blocks = blocks_x*blocks_y;
+	for (int t=begin; t<end; t++){
+		int* offsets = &bin_offsets[t*num_blocks];
+		for (int i=obj->size*(long) t/threads, i_end=obj->size*(long) (t+1)/threads; i<i_end; i++)
+			block_particles[offsets[particle_block[i]]++] = i;
 	}
-	collisionGrid();
 }
 
 #if ENABLE_IMPLICIT
@@ -147,192 +571,781 @@ void Grid::implicitVelocities(){
 	//But for implicit, we use the force at the next timestep, f[n+1]
 	//Stomakhin interpolates between the two, using IMPLICIT_RATIO
 	//If we call v* the explicit vf, we can do some algebra and get
-	//	v* = vf - IMPLICIT_RATION*dt*(df/m)
-	//The problem is, df (change in force from n to n+1) depends on vf,
-	//so we can't just compute it directly; instead, we use an iterative
-	//method (conjugate residuals) to find what vf should be. We make an
-	//initial guess of what vf should be (setting it to v*) and then
-	//iteratively refine our guess until the error is small enough.
+	//	v* = vf - IMPLICIT_RATIO*dt*(df/m)
+	//df (change in force from n to n+1) is linear in vf; multiplying both sides by the
+	//node masses gives a symmetric system H*vf = m*v*. By default we solve it with
+	//preconditioned conjugate residuals, using dot products over the whole grid, and H
+	//itself is never built; implicitOperator applies it by going through the particles.
+	//The other solvers assemble H as a sparse matrix instead (see solveAssembled).
 	
-	//INITIALIZE LINEAR SOLVE
-	for (int idx=0; idx<nodes_length; idx++){
-		GridNode& n = nodes[idx];
-		n.imp_active = n.active;
-		if (n.imp_active){
-			//recomputeImplicitForces will compute Er, given r
-			//Initially, we want vf - E*vf; so we'll temporarily set r to vf
-			n.r.setData(n.velocity_new);
-			//Also set the error to 1
-			n.err.setData(1);
-		}
-	}
-	//As said before, we need to compute vf-E*vf as our initial "r" residual
-	recomputeImplicitForces();
-	for (int idx=0; idx<nodes_length; idx++){
-		GridNode& n = nodes[idx];
-		if (n.imp_active){
-			n.r = n.velocity_new - n.Er;
-			//p starts out equal to residual
-			n.p = n.r;
-			//cache r.dot(Er)
-			n.rEr = n.r.dot(n.Er);
-		}
-	}
-	//Since we updated r, we need to recompute Er
-	recomputeImplicitForces();
-	//Ep starts out the same as Er
-	for (int idx=0; idx<nodes_length; idx++){
-		GridNode& n = nodes[idx];
-		if (n.imp_active)
-			n.Ep = n.Er;
+	if (implicit_integrator == INTEGRATOR_OPTIMIZATION){
+		optimizeVelocities();
+		return;
 	}
+	stiffness_scale = IMPLICIT_RATIO*TIMESTEP;
+	
+	//The stress derivatives (rotation, cofactor and so on) don't depend on the
+	//velocities, so we do them once per particle, rather than once per iteration
+	stress_derivative.resize(obj->size*STRESS_DERIVATIVE);
+	ThreadPool::shared()->run<Grid, &Grid::linearizeStress>(this, obj->size);
+	
+	//Initial guess is v* plus the velocity change from the last solve, since the
+	//stiffness doesn't change much between steps
+	double rhs_norm = reduceNodes<&Grid::implicitStartNode>();
+	if (rhs_norm <= 0)
+		return;
+	solveSystem(rhs_norm, IMPLICIT_TOLERANCE);
+	
+	//Keep the velocity changes for next step's guess
+	updateNodes<&Grid::implicitFinishNode>();
+	memset(&block_solved[0], 0, block_solved.size());
+	for (int b=0; b<(int) active_blocks.size(); b++)
+		block_solved[active_blocks[b]] = 1;
+}
+void Grid::solveSystem(double rhs_norm, float tolerance){
+	if (implicit_solver == SOLVER_MATRIX_FREE)
+		solveMatrixFree(rhs_norm, tolerance);
+	else solveAssembled(tolerance);
+}
+void Grid::solveMatrixFree(double rhs_norm, float rel_tolerance){
+	implicitOperator();
+	double residual = reduceNodes<&Grid::implicitResidualNode>(),
+		tolerance = rhs_norm*rel_tolerance*rel_tolerance,
+		zHz = 0, zHz_start = 0;
+	precondition<&GridNode::r, &GridNode::z>();
 	
 	//LINEAR SOLVE
-	for (int i=0; i<MAX_IMPLICIT_ITERS; i++){
-		bool done = true;
-		for (int idx=0; idx<nodes_length; idx++){
-			GridNode& n = nodes[idx];
-			//Only perform calculations on nodes that haven't been solved yet
-			if (n.imp_active){
-				//Alright, so we'll handle each node's solve separately
-				//First thing to do is update our vf guess
-				float div = n.Ep.dot(n.Ep);
-				float alpha = n.rEr / div;
-				n.err = alpha*n.p;
-				//If the error is small enough, we're done
-				float err = n.err.length();
-				if (err < MAX_IMPLICIT_ERR || err > MIN_IMPLICIT_ERR || isnan(err)){
-					n.imp_active = false;
-					continue;
-				}
-				else done = false;
-				//Update vf and residual
-				n.velocity_new += n.err;
-				n.r -= alpha*n.Ep;
+	for (int i=0; i<MAX_IMPLICIT_ITERS && residual > tolerance; i++, implicit_iterations++){
+		implicitOperator();
+		double zHz_new = reduceNodes<&Grid::implicitOperatorNode>();
+		//With stiff snow, float round-off puts a floor under the residual; so we also
+		//stop once the preconditioned residual has come down as far
+		if (!i)
+			zHz_start = zHz_new;
+		else if (zHz_new <= zHz_start*rel_tolerance*rel_tolerance)
+			break;
+		//New search direction is z, made conjugate to the last one
+		implicit_beta = i ? zHz_new/zHz : 0;
+		zHz = zHz_new;
+		updateNodes<&Grid::implicitDirectionNode>();
+		double Hpq = precondition<&GridNode::Hp, &GridNode::q>();
+		//Also catches NaNs, if the operator has blown up
+		if (!(Hpq > 0))
+			break;
+		//Step along it to minimize the (preconditioned) residual
+		implicit_alpha = zHz/Hpq;
+		residual = reduceNodes<&Grid::implicitStepNode>();
+	}
+}
+//Computes the delta force for the velocities in z: each particle gathers the velocity
+//gradient z gives it, and scatters the resulting change in stress back to the nodes
+void Grid::implicitOperator(){
+	ThreadPool* pool = ThreadPool::shared();
+	delta_stress.resize(obj->size);
+	switch (weight_mode){
+		case WEIGHTS_CACHED:
+			pool->run<Grid, &Grid::gatherDeltaStress<WEIGHTS_CACHED> >(this, obj->size);
+			scatter<&Grid::scatterDeltaForce<WEIGHTS_CACHED> >();
+			break;
+		case WEIGHTS_SEPARABLE:
+			pool->run<Grid, &Grid::gatherDeltaStress<WEIGHTS_SEPARABLE> >(this, obj->size);
+			scatter<&Grid::scatterDeltaForce<WEIGHTS_SEPARABLE> >();
+			break;
+		case WEIGHTS_RECOMPUTE:
+			pool->run<Grid, &Grid::gatherDeltaStress<WEIGHTS_RECOMPUTE> >(this, obj->size);
+			scatter<&Grid::scatterDeltaForce<WEIGHTS_RECOMPUTE> >();
+			break;
+	}
+}
+void Grid::linearizeStress(int begin, int end, int /*thread*/){
+	//The optimization linearizes around its trial velocities, rather than the start of the step
+	bool trial = implicit_integrator == INTEGRATOR_OPTIMIZATION;
+	for (int i=begin; i<end; i++){
+		float* derivative = &stress_derivative[i*STRESS_DERIVATIVE];
+		//Delta stress for each entry of the velocity gradient, in the
+		//[column][row] order Matrix2f stores them in
+		for (int k=0; k<4; k++){
+			Matrix2f unit;
+			unit.data[k/2][k%2] = 1;
+			Matrix2f stress = trial ?
+				obj->deltaStress(i, unit, trial_elastic[i], trial_rotation[i], trial_stretch[i]) :
+				obj->deltaStress(i, unit);
+			memcpy(derivative+4*k, stress.data, 4*sizeof(float));
+		}
+	}
+}
+template<int mode>
+void Grid::gatherDeltaStress(int begin, int end, int /*thread*/){
+	for (int i=begin; i<end; i++){
+		Stencil<mode> stencil(this, i);
+		//Velocity gradient for z (sum of z*grad(w)), stored [column][row]
+		float grad[4] = {0, 0, 0, 0};
+		int ox = GridKernel::first(obj->grid_position[i][0]),
+			oy = GridKernel::first(obj->grid_position[i][1]);
+		for (int idx=0, y=oy, y_end=y+GridKernel::SIZE; y<y_end; y++){
+			for (int x=ox, x_end=x+GridKernel::SIZE; x<x_end; x++, idx++){
+				//Inactive nodes have zero z
+				const float* z = nodes[(int) (y*size[0]+x)].z.data;
+				const Vector2f& g = stencil.gradient(idx);
+				grad[0] += z[0]*g.data[0];
+				grad[1] += z[1]*g.data[0];
+				grad[2] += z[0]*g.data[1];
+				grad[3] += z[1]*g.data[1];
 			}
 		}
-		//If all the velocities converged, we're done
-		if (done) break;
-		//Otherwise we recompute Er, so we can compute our next guess
-		recomputeImplicitForces();
-		//Calculate the gradient for our next guess
-		for (int idx=0; idx<nodes_length; idx++){
-			GridNode& n = nodes[idx];
-			if (n.imp_active){
-				float temp = n.r.dot(n.Er);
-				float beta = temp / n.rEr;
-				n.rEr = temp;
-				//Update p
-				n.p *= beta;
-				n.p += n.r;
-				//Update Ep
-				n.Ep *= beta;
-				n.Ep += n.Er;
+		//Delta stress is the contraction of the gradient with the stress derivative
+		const float* derivative = &stress_derivative[i*STRESS_DERIVATIVE];
+		float* stress = &delta_stress[i].data[0][0];
+		for (int j=0; j<4; j++)
+			stress[j] = grad[0]*derivative[j] + grad[1]*derivative[4+j] +
+				grad[2]*derivative[8+j] + grad[3]*derivative[12+j];
+	}
+}
+template<int mode>
+void Grid::scatterDeltaForce(int i){
+	const float* stress = &delta_stress[i].data[0][0];
+	Stencil<mode> stencil(this, i);
+	int ox = GridKernel::first(obj->grid_position[i][0]),
+		oy = GridKernel::first(obj->grid_position[i][1]);
+	for (int idx=0, y=oy, y_end=y+GridKernel::SIZE; y<y_end; y++){
+		for (int x=ox, x_end=x+GridKernel::SIZE; x<x_end; x++, idx++){
+			//force += stress*grad(w)
+			float* force = nodes[(int) (y*size[0]+x)].force.data;
+			const Vector2f& g = stencil.gradient(idx);
+			force[0] += stress[0]*g.data[0] + stress[2]*g.data[1];
+			force[1] += stress[1]*g.data[0] + stress[3]*g.data[1];
+		}
+	}
+}
+//Node kernels for the solve
+double Grid::implicitStartNode(int idx, int x, int y){
+	GridNode& n = nodes[idx];
+	if (!n.active)
+		return 0;
+	n.rhs = n.velocity_new;
+	//implicitOperator works on z, so that's where the initial guess goes for now
+	n.z = n.velocity_new;
+	if (block_solved[(y/GRID_BLOCK)*blocks_x + x/GRID_BLOCK])
+		n.z += implicit_guess[idx];
+	return n.mass*n.rhs.dot(n.rhs);
+}
+double Grid::implicitResidualNode(int idx, int /*x*/, int /*y*/){
+	GridNode& n = nodes[idx];
+	if (!n.active)
+		return 0;
+	//r = m*v* - H*vf, for the initial guess; the optimization's fixed nodes are left
+	//out of the system, so they stay at zero
+	n.velocity_new = n.z;
+	if (n.fixed)
+		n.r.setData(0.0);
+	else n.r = n.mass*(n.rhs - n.z) - stiffness_scale*n.force;
+	n.force.setData(0.0);
+	return n.r.dot(n.r)/n.mass;
+}
+double Grid::implicitOperatorNode(int idx, int /*x*/, int /*y*/){
+	GridNode& n = nodes[idx];
+	if (!n.active)
+		return 0;
+	if (n.fixed)
+		n.Hz.setData(0.0);
+	else n.Hz = n.mass*n.z + stiffness_scale*n.force;
+	n.force.setData(0.0);
+	return n.z.dot(n.Hz);
+}
+void Grid::implicitDirectionNode(int idx, int /*x*/, int /*y*/){
+	GridNode& n = nodes[idx];
+	if (n.active){
+		n.p = n.z + implicit_beta*n.p;
+		n.Hp = n.Hz + implicit_beta*n.Hp;
+	}
+}
+double Grid::implicitStepNode(int idx, int /*x*/, int /*y*/){
+	GridNode& n = nodes[idx];
+	if (!n.active)
+		return 0;
+	n.velocity_new += implicit_alpha*n.p;
+	n.r -= implicit_alpha*n.Hp;
+	//z = P*r, without applying the preconditioner again
+	n.z -= implicit_alpha*n.q;
+	return n.r.dot(n.r)/n.mass;
+}
+void Grid::implicitFinishNode(int idx, int x, int y){
+	GridNode& n = nodes[idx];
+	if (n.active){
+		implicit_guess[idx] = n.velocity_new - n.rhs;
+		//The solve can push nodes back into the walls
+		collisionNode(idx, x, y);
+	}
+	else implicit_guess[idx].setData(0.0);
+}
+
+//Backward Euler, written as an optimization: the velocities at the end of the step minimize
+//	E(v) = sum of m/2*|v - v*|^2 over the nodes + sum of the particles' elastic energy
+//where v* is the velocity without stress forces, and each particle's elastic deformation
+//gradient is (I + dt*grad(v))*F. The gradient of E is m*(v - v*) + dt*f(v), so at the
+//minimum the stress is taken at the end of the step, rather than linearized at its start.
+//Each Newton step solves the same kind of system as the semi-implicit update, linearized
+//around the current velocities; a backtracking line search makes sure E goes down, which
+//keeps the solve stable with much larger steps
+void Grid::optimizeVelocities(){
+	stiffness_scale = TIMESTEP;
+	trial_elastic.resize(obj->size);
+	trial_rotation.resize(obj->size);
+	trial_stretch.resize(obj->size);
+	energy_sums.resize((obj->size + ENERGY_CHUNK-1)/ENERGY_CHUNK);
+	stress_derivative.resize(obj->size*STRESS_DERIVATIVE);
+	
+	//Start from v* plus the velocity change from the last step
+	double target_norm = reduceNodes<&Grid::newtonStartNode>();
+	if (target_norm <= 0)
+		return;
+	double potential = incrementalPotential(0),
+		tolerance = target_norm*NEWTON_TOLERANCE*NEWTON_TOLERANCE;
+	for (int i=0; i<MAX_NEWTON_ITERS; i++){
+		//The guess from the last step can already be close enough, but the stress has
+		//changed since then, so we always take at least one Newton step; this also
+		//catches NaNs, if the stress has blown up
+		double gradient = reduceNodes<&Grid::newtonGradientNode>();
+		if (!(gradient >= 0) || (i && gradient <= tolerance))
+			break;
+		newton_iterations++;
+		//Newton step: H*step = -gradient, with H linearized at the current velocities.
+		//Far from the minimum, the linearization is only rough, so the step is too
+		//(inexact Newton); the solve gets tighter as the gradient comes down
+		ThreadPool::shared()->run<Grid, &Grid::linearizeStress>(this, obj->size);
+		float forcing = sqrt(gradient/target_norm);
+		solveSystem(gradient, std::max(IMPLICIT_TOLERANCE, std::min(MAX_NEWTON_FORCING, forcing)));
+		//The elastic energy isn't convex, so H can be indefinite, and the step can point
+		//uphill; if it does, we step along the negative gradient (divided by mass) instead
+		double slope = reduceNodes<&Grid::newtonSlopeNode>();
+		if (!(slope < 0))
+			slope = reduceNodes<&Grid::newtonDescentNode>();
+		
+		//LINE SEARCH
+		float alpha = 1;
+		double next = incrementalPotential(alpha);
+		for (int j=0; j<LINE_SEARCH_STEPS && !(next <= potential + LINE_SEARCH_DECREASE*alpha*slope); j++){
+			alpha /= 2;
+			next = incrementalPotential(alpha);
+		}
+		//If even a tiny step doesn't help, float round-off has the last word
+		if (!(next <= potential + LINE_SEARCH_DECREASE*alpha*slope))
+			break;
+		updateNodes<&Grid::newtonStepNode>();
+		potential = next;
+	}
+	
+	//Keep the velocity changes for next step's guess
+	updateNodes<&Grid::newtonFinishNode>();
+	memset(&block_solved[0], 0, block_solved.size());
+	for (int b=0; b<(int) active_blocks.size(); b++)
+		block_solved[active_blocks[b]] = 1;
+}
+//Moves the trial velocities alpha along the Newton step, and returns the potential there;
+//it leaves the negative gradient (divided by mass) in rhs, and each particle's trial
+//deformation gradient, for linearizing around
+double Grid::incrementalPotential(float alpha){
+	ThreadPool* pool = ThreadPool::shared();
+	newton_alpha = alpha;
+	delta_stress.resize(obj->size);
+	//The trial stress goes to the grid the same way as the implicit operator's delta stress
+	switch (weight_mode){
+		case WEIGHTS_CACHED:
+			pool->run<Grid, &Grid::gatherTrialStress<WEIGHTS_CACHED> >(this, obj->size, ENERGY_CHUNK);
+			scatter<&Grid::scatterDeltaForce<WEIGHTS_CACHED> >();
+			break;
+		case WEIGHTS_SEPARABLE:
+			pool->run<Grid, &Grid::gatherTrialStress<WEIGHTS_SEPARABLE> >(this, obj->size, ENERGY_CHUNK);
+			scatter<&Grid::scatterDeltaForce<WEIGHTS_SEPARABLE> >();
+			break;
+		case WEIGHTS_RECOMPUTE:
+			pool->run<Grid, &Grid::gatherTrialStress<WEIGHTS_RECOMPUTE> >(this, obj->size, ENERGY_CHUNK);
+			scatter<&Grid::scatterDeltaForce<WEIGHTS_RECOMPUTE> >();
+			break;
+	}
+	double potential = reduceNodes<&Grid::newtonPotentialNode>();
+	for (int c=0; c<(int) energy_sums.size(); c++)
+		potential += energy_sums[c];
+	return potential;
+}
+template<int mode>
+void Grid::gatherTrialStress(int begin, int end, int /*thread*/){
+	//The pool can hand out several chunks at once (with one thread, all of them)
+	double energy = 0;
+	for (int i=begin; i<end; i++){
+		Stencil<mode> stencil(this, i);
+		//Velocity gradient for the trial velocities, stored [column][row]
+		Matrix2f vel_grad;
+		float* grad = &vel_grad.data[0][0];
+		int ox = GridKernel::first(obj->grid_position[i][0]),
+			oy = GridKernel::first(obj->grid_position[i][1]);
+		for (int idx=0, y=oy, y_end=y+GridKernel::SIZE; y<y_end; y++){
+			for (int x=ox, x_end=x+GridKernel::SIZE; x<x_end; x++, idx++){
+				//Inactive nodes have zero velocity and step
+				const GridNode& n = nodes[(int) (y*size[0]+x)];
+				Vector2f v = n.iterate + newton_alpha*n.step;
+				const Vector2f& g = stencil.gradient(idx);
+				grad[0] += v.data[0]*g.data[0];
+				grad[1] += v.data[1]*g.data[0];
+				grad[2] += v.data[0]*g.data[1];
+				grad[3] += v.data[1]*g.data[1];
 			}
 		}
+		//Same update as PointCloud::updateGradient
+		vel_grad *= TIMESTEP;
+		vel_grad.diag_sum(1);
+		trial_elastic[i].setData(vel_grad*obj->def_elastic[i]);
+		energy += obj->trialEnergy(i, trial_elastic[i], delta_stress[i], trial_rotation[i], trial_stretch[i]);
+		if ((i+1) % ENERGY_CHUNK == 0 || i+1 == end){
+			energy_sums[i/ENERGY_CHUNK] = energy;
+			energy = 0;
+		}
+	}
+}
+//Node kernels for the optimization
+double Grid::newtonStartNode(int idx, int x, int y){
+	GridNode& n = nodes[idx];
+	if (!n.active)
+		return 0;
+	//explicitNode has already divided the momentum by mass. Nodes heading into the
+	//walls are held at their collision response, so the snow pushes against them
+	Vector2f target = n.velocity + TIMESTEP*gravity;
+	n.velocity_new = target;
+	collisionNode(idx, x, y);
+	n.target = n.iterate = n.velocity_new;
+	n.fixed = n.target[0] != target[0] || n.target[1] != target[1];
+	if (!n.fixed && block_solved[(y/GRID_BLOCK)*blocks_x + x/GRID_BLOCK])
+		n.iterate += implicit_guess[idx];
+	n.step.setData(0.0);
+	return n.mass*n.target.dot(n.target);
+}
+double Grid::newtonPotentialNode(int idx, int /*x*/, int /*y*/){
+	GridNode& n = nodes[idx];
+	if (!n.active)
+		return 0;
+	Vector2f dv = n.iterate + newton_alpha*n.step - n.target;
+	if (n.fixed)
+		n.rhs.setData(0.0);
+	else n.rhs = -(dv + (TIMESTEP/n.mass)*n.force);
+	n.force.setData(0.0);
+	return .5*n.mass*dv.dot(dv);
+}
+double Grid::newtonGradientNode(int idx, int /*x*/, int /*y*/){
+	GridNode& n = nodes[idx];
+	if (!n.active)
+		return 0;
+	//The linear solve starts from a zero step
+	n.z.setData(0.0);
+	return n.mass*n.rhs.dot(n.rhs);
+}
+double Grid::newtonSlopeNode(int idx, int /*x*/, int /*y*/){
+	GridNode& n = nodes[idx];
+	if (!n.active)
+		return 0;
+	if (n.fixed)
+		n.step.setData(0.0);
+	else n.step = n.velocity_new;
+	return -n.mass*n.rhs.dot(n.step);
+}
+double Grid::newtonDescentNode(int idx, int /*x*/, int /*y*/){
+	GridNode& n = nodes[idx];
+	if (!n.active)
+		return 0;
+	n.step = n.rhs;
+	return -n.mass*n.rhs.dot(n.rhs);
+}
+void Grid::newtonStepNode(int idx, int /*x*/, int /*y*/){
+	GridNode& n = nodes[idx];
+	if (n.active)
+		n.iterate += newton_alpha*n.step;
+}
+void Grid::newtonFinishNode(int idx, int x, int y){
+	GridNode& n = nodes[idx];
+	if (n.active){
+		n.velocity_new = n.iterate;
+		implicit_guess[idx] = n.iterate - n.target;
+		//The solve can push nodes back into the walls
+		if (!n.fixed)
+			collisionNode(idx, x, y);
+	}
+	else implicit_guess[idx].setData(0.0);
+}
+
+//Delta stress of a particle (from its stress derivative) for a unit velocity along
+//each axis, at a node with weight gradient g; two matrices, stored [column][row]
+static inline void unitStress(const float* derivative, const float* g, float* stress){
+	for (int a=0; a<2; a++){
+		for (int k=0; k<4; k++)
+			stress[4*a+k] = g[0]*derivative[4*a+k] + g[1]*derivative[4*(2+a)+k];
+	}
+}
+//Adds the force at a node with weight gradient g, for unit_stress (see above), to a
+//2x2 block of the system
+static inline void addStiffness(const float* unit_stress, const float* g, float scale, float* block){
+	for (int a=0; a<2; a++){
+		const float* stress = unit_stress+4*a;
+		block[2*a] += scale*(stress[0]*g[0] + stress[2]*g[1]);
+		block[2*a+1] += scale*(stress[1]*g[0] + stress[3]*g[1]);
+	}
+}
+
+//The solve is preconditioned with the node masses, which is what the mass weighted
+//residual amounts to; this sets out = in/m on each node, and returns the sum of in.dot(out)
+template<Vector2f GridNode::*in, Vector2f GridNode::*out>
+double Grid::precondition(){
+	return reduceNodes<&Grid::preconditionNode<in, out> >();
+}
+template<Vector2f GridNode::*in, Vector2f GridNode::*out>
+double Grid::preconditionNode(int idx, int /*x*/, int /*y*/){
+	GridNode& n = nodes[idx];
+	if (!n.active)
+		return 0;
+	Vector2f& result = n.*out;
+	result = (n.*in)/n.mass;
+	if (n.fixed)
+		result.setData(0.0);
+	return (n.*in).dot(result);
+}
+
+//Eigen's defaults for the incomplete LU keep nearly everything, which makes it about
+//as slow as a direct factorization
+template<class Preconditioner>
+static void setupPreconditioner(Preconditioner&){}
+static void setupPreconditioner(Eigen::IncompleteLUT<float>& ilut){
+	ilut.setDroptol(ILUT_DROP_TOLERANCE);
+	ilut.setFillfactor(ILUT_FILL_FACTOR);
+}
+//Runs one of Eigen's iterative solvers, starting from the guess in v; returns the
+//number of iterations (Eigen doesn't count the one that converges)
+template<class Solver>
+static int iterativeSolve(const Eigen::SparseMatrix<float>& H, const Eigen::VectorXf& b, Eigen::VectorXf& v, float tolerance){
+	Solver solver;
+	solver.setMaxIterations(MAX_IMPLICIT_ITERS);
+	solver.setTolerance(tolerance);
+	setupPreconditioner(solver.preconditioner());
+	solver.compute(H);
+	if (solver.info() != Eigen::Success){
+		v.setConstant(NAN);
+		return 0;
 	}
+	v = solver.solveWithGuess(b, v);
+	return solver.iterations();
 }
-void Grid::recomputeImplicitForces(){
-	for (int i=0; i<obj->size; i++){
-		Particle& p = obj->particles[i];
-		int ox = p.grid_position[0],
-			oy = p.grid_position[1];
-		for (int idx=0, y=oy-1, y_end=y+3; y<=y_end; y++){
-			for (int x=ox-1, x_end=x+3; x<=x_end; x++, idx++){
-				GridNode& n = nodes[(int) (y*size[0]+x)];
-				if (n.imp_active){
-					//I don't think there is any way to cache intermediary
-					//results for reuse with each iteration, unfortunately
-					n.force += p.deltaForce(n.r, p.weight_gradient[idx]);
+//Each iteration of the matrix-free solve gathers from and scatters to the whole stencil
+//of every particle. Here that is done once, to build H, and each iteration is just a
+//sparse matrix product over the active nodes, which is much cheaper when there are many
+//particles per node. Eigen's iterative solvers stop at a relative residual of
+//tolerance, measured without the node masses
+void Grid::solveAssembled(float tolerance){
+	//Number the active nodes (except the optimization's fixed ones); the matrix has a
+	//row and column for each velocity component. They're numbered in row order over the
+	//whole grid, so each node's neighbors come in increasing order too
+	block_slot.assign(blocks_x*blocks_y, -1);
+	for (int b=0; b<(int) active_blocks.size(); b++)
+		block_slot[active_blocks[b]] = b;
+	int slot_nodes = active_blocks.size()*GRID_BLOCK*GRID_BLOCK, unknowns = 0;
+	node_unknown.assign(slot_nodes, -1);
+	system_order.clear();
+	for (int y=0; y<size[1]; y++){
+		for (int x=0; x<size[0]; x++){
+			if (block_slot[(y/GRID_BLOCK)*blocks_x + x/GRID_BLOCK] < 0)
+				continue;
+			const GridNode& n = nodes[(int) (y*size[0]+x)];
+			if (n.active && !n.fixed){
+				node_unknown[nodeSlot(x, y)] = unknowns++;
+				system_order.push_back(y*size[0]+x);
+			}
+		}
+	}
+	
+	//Stiffness blocks of each node, from the particles
+	system_blocks.assign(slot_nodes*SYSTEM_STENCIL*4, 0);
+	switch (weight_mode){
+		case WEIGHTS_CACHED: scatter<&Grid::assembleMatrix<WEIGHTS_CACHED> >(); break;
+		case WEIGHTS_SEPARABLE: scatter<&Grid::assembleMatrix<WEIGHTS_SEPARABLE> >(); break;
+		case WEIGHTS_RECOMPUTE: scatter<&Grid::assembleMatrix<WEIGHTS_RECOMPUTE> >(); break;
+	}
+	
+	//H = M + stiffness_scale*K, the right hand side m*v*, and the initial guess (in z).
+	//H is symmetric, so each node's blocks can be written straight into its own two
+	//columns; going through the nodes in order, every entry is appended to the end of
+	//the matrix, so it is built in one pass without any sorting or searching
+	const int w = 2*GridKernel::SIZE-1, r = GridKernel::SIZE-1;
+	int entries = 0;
+	for (int u=0; u<unknowns; u++){
+		int x = system_order[u] % (int) size[0], y = system_order[u] / (int) size[0];
+		for (int k=0; k<SYSTEM_STENCIL; k++)
+			entries += systemColumn(x + k%w - r, y + k/w - r) >= 0;
+	}
+	Eigen::SparseMatrix<float> H(2*unknowns, 2*unknowns);
+	H.reserve(4*entries);
+	Eigen::VectorXf b(2*unknowns), v(2*unknowns);
+	for (int row=0; row<unknowns; row++){
+		int x = system_order[row] % (int) size[0], y = system_order[row] / (int) size[0];
+		const GridNode& n = nodes[system_order[row]];
+		const float* blocks = &system_blocks[nodeSlot(x, y)*SYSTEM_STENCIL*4];
+		//Blocks are stored [column][row]; by symmetry, each one also gives the node's
+		//column of H
+		for (int e_row=0; e_row<2; e_row++){
+			H.startVec(2*row + e_row);
+			for (int k=0; k<SYSTEM_STENCIL; k++){
+				int column = systemColumn(x + k%w - r, y + k/w - r);
+				if (column < 0)
+					continue;
+				for (int e_col=0; e_col<2; e_col++){
+					int e = 2*e_col + e_row;
+					H.insertBack(2*column + e_col, 2*row + e_row) = blocks[4*k+e] + (column == row && e%3 == 0 ? n.mass : 0);
 				}
 			}
 		}
+		for (int e=0; e<2; e++){
+			b[2*row+e] = n.mass*n.rhs.data[e];
+			v[2*row+e] = n.z.data[e];
+		}
+	}
+	H.finalize();
+	
+	//LINEAR SOLVE
+	typedef Eigen::SparseMatrix<float> Matrix;
+	bool ilut = implicit_preconditioner == PRECONDITIONER_ILUT;
+	switch (implicit_solver){
+		case SOLVER_CG:
+			implicit_iterations += ilut ?
+				iterativeSolve<Eigen::ConjugateGradient<Matrix, Eigen::Lower, Eigen::IncompleteLUT<float> > >(H, b, v, tolerance) :
+				iterativeSolve<Eigen::ConjugateGradient<Matrix, Eigen::Lower, Eigen::DiagonalPreconditioner<float> > >(H, b, v, tolerance);
+			break;
+		case SOLVER_BICGSTAB:
+			implicit_iterations += ilut ?
+				iterativeSolve<Eigen::BiCGSTAB<Matrix, Eigen::IncompleteLUT<float> > >(H, b, v, tolerance) :
+				iterativeSolve<Eigen::BiCGSTAB<Matrix, Eigen::DiagonalPreconditioner<float> > >(H, b, v, tolerance);
+			break;
+		default:{
+			Eigen::SimplicialLDLT<Matrix> ldlt(H);
+			if (ldlt.info() == Eigen::Success)
+				v = ldlt.solve(b);
+			else v.setConstant(NAN);
+			break;
+		}
 	}
 	
-	//We have delta force for each node; to get Er, we use the following formula:
-	//	r - IMPLICIT_RATIO*TIMESTEP*delta_force/mass
-	for (int idx=0; idx<nodes_length; idx++){
-		GridNode& n = nodes[idx];
-		if (n.imp_active)
-			n.Er = n.r - IMPLICIT_RATIO*TIMESTEP/n.mass*n.force;
+	//If the solve broke down, keep the explicit velocities
+	bool failed = !v.allFinite();
+	for (int row=0; row<unknowns; row++){
+		GridNode& n = nodes[system_order[row]];
+		n.velocity_new = failed ? n.rhs : Vector2f(v[2*row], v[2*row+1]);
+	}
+}
+//Index of a node in the assembled system's per-node arrays, which only cover the
+//active blocks
+int Grid::nodeSlot(int x, int y) const{
+	int slot = block_slot[(y/GRID_BLOCK)*blocks_x + x/GRID_BLOCK];
+	return slot*GRID_BLOCK*GRID_BLOCK + (y%GRID_BLOCK)*GRID_BLOCK + x%GRID_BLOCK;
+}
+//Index of a node in the assembled system, or -1 if it's outside the active blocks, or
+//not an unknown
+int Grid::systemColumn(int x, int y) const{
+	if (x < 0 || y < 0 || x >= size[0] || y >= size[1] ||
+		block_slot[(y/GRID_BLOCK)*blocks_x + x/GRID_BLOCK] < 0)
+		return -1;
+	return node_unknown[nodeSlot(x, y)];
+}
+//Adds a particle's stiffness to the system blocks of its nodes, for every pair of them
+template<int mode>
+void Grid::assembleMatrix(int i){
+	const int n = GridKernel::SIZE, w = 2*GridKernel::SIZE-1;
+	const float* derivative = &stress_derivative[i*STRESS_DERIVATIVE];
+	float scale = stiffness_scale;
+	Stencil<mode> stencil(this, i);
+	int ox = GridKernel::first(obj->grid_position[i][0]),
+		oy = GridKernel::first(obj->grid_position[i][1]);
+	float unit_stress[n*n][8];
+	for (int k=0; k<n*n; k++)
+		unitStress(derivative, stencil.gradient(k).data, unit_stress[k]);
+	for (int j=0; j<n*n; j++){
+		float* blocks = &system_blocks[nodeSlot(ox+j%n, oy+j/n)*SYSTEM_STENCIL*4];
+		const Vector2f& g = stencil.gradient(j);
+		for (int k=0; k<n*n; k++)
+			addStiffness(unit_stress[k], g.data, scale, blocks+4*((k/n - j/n + n-1)*w + k%n - j%n + n-1));
+	}
+}
+
+//Sum a node kernel over the active blocks; each block is summed on its own, and
+//the blocks are added up in order, so the sum doesn't depend on the threads
+template<double (Grid::*kernel)(int, int, int)>
+double Grid::reduceNodes(){
+	block_sums.resize(active_blocks.size());
+	ThreadPool::shared()->run<Grid, &Grid::reduceBlocks<kernel> >(this, active_blocks.size());
+	double sum = 0;
+	for (int b=0; b<(int) block_sums.size(); b++)
+		sum += block_sums[b];
+	return sum;
+}
+template<double (Grid::*kernel)(int, int, int)>
+void Grid::reduceBlocks(int begin, int end, int /*thread*/){
+	for (int b=begin; b<end; b++){
+		int x_start, x_end, y_start, y_end;
+		blockNodes(active_blocks[b], x_start, x_end, y_start, y_end);
+		double sum = 0;
+		for (int y=y_start; y<y_end; y++){
+			for (int x=x_start, idx=y*size[0]+x_start; x<x_end; x++, idx++)
+				sum += (this->*kernel)(idx, x, y);
+		}
+		block_sums[b] = sum;
 	}
 }
 #endif
 
 //Map grid velocities back to particles
 void Grid::updateVelocities() const{
-	for (int i=0; i<obj->size; i++){
-		Particle& p = obj->particles[i];
+	//Each particle only reads from the grid, so there are no conflicts
+	ThreadPool* pool = ThreadPool::shared();
+	if (transfer_mode == TRANSFER_MLS){
+		switch (weight_mode){
+			case WEIGHTS_CACHED: pool->run<Grid, &Grid::gatherAffine<WEIGHTS_CACHED> >(this, obj->size); break;
+			case WEIGHTS_SEPARABLE: pool->run<Grid, &Grid::gatherAffine<WEIGHTS_SEPARABLE> >(this, obj->size); break;
+			case WEIGHTS_RECOMPUTE: pool->run<Grid, &Grid::gatherAffine<WEIGHTS_RECOMPUTE> >(this, obj->size); break;
+		}
+	}
+	else switch (weight_mode){
+		case WEIGHTS_CACHED: pool->run<Grid, &Grid::updateVelocities<WEIGHTS_CACHED> >(this, obj->size); break;
+		case WEIGHTS_SEPARABLE: pool->run<Grid, &Grid::updateVelocities<WEIGHTS_SEPARABLE> >(this, obj->size); break;
+		case WEIGHTS_RECOMPUTE: pool->run<Grid, &Grid::updateVelocities<WEIGHTS_RECOMPUTE> >(this, obj->size); break;
+	}
+}
+template<int mode>
+void Grid::updateVelocities(int begin, int end, int thread) const{
+	for (int i=begin; i<end; i++){
 		//We calculate PIC and FLIP velocities separately
-		Vector2f pic, flip = p.velocity;
+		Vector2f pic, flip = obj->velocity[i];
 		//Also keep track of velocity gradient
-		Matrix2f& grad = p.velocity_gradient;
+		Matrix2f& grad = obj->velocity_gradient[i];
 		grad.setData(0.0);
 		//VISUALIZATION PURPOSES ONLY:
 		//Recompute density
-		p.density = 0;
+		float& density = obj->density[i];
+		density = 0;
 		
-		int ox = p.grid_position[0],
-			oy = p.grid_position[1];
-		for (int idx=0, y=oy-1, y_end=y+3; y<=y_end; y++){
-			for (int x=ox-1, x_end=x+3; x<=x_end; x++, idx++){
-				float w = p.weights[idx];
-				if (w > BSPLINE_EPSILON){
-					GridNode &node = nodes[(int) (y*size[0]+x)];
-					//Particle in cell
-					pic += node.velocity_new*w;
-					//Fluid implicit particle
-					flip += (node.velocity_new - node.velocity)*w;
-					//Velocity gradient
-					grad += node.velocity_new.outer_product(p.weight_gradient[idx]);
-					//VISUALIZATION ONLY: Update density
-					p.density += w * node.mass;
+		int ox = GridKernel::first(obj->grid_position[i][0]),
+			oy = GridKernel::first(obj->grid_position[i][1]);
+		if (simd != NULL){
+			SimdStencil<mode> stencil(this, simd, i, true);
+			Vector2f flip_delta;
+			simd->gatherParticle(&nodes[(int) (oy*size[0]+ox)], size[0], stencil.weights, stencil.gradients,
+				pic, flip_delta, grad, density);
+			flip += flip_delta;
+		}
+		else{
+			Stencil<mode> stencil(this, i);
+			for (int idx=0, y=oy, y_end=y+GridKernel::SIZE; y<y_end; y++){
+				for (int x=ox, x_end=x+GridKernel::SIZE; x<x_end; x++, idx++){
+					float w = stencil.weight(idx);
+					if (w > BSPLINE_EPSILON){
+						GridNode &node = nodes[(int) (y*size[0]+x)];
+						//Particle in cell
+						pic += node.velocity_new*w;
+						//Fluid implicit particle
+						flip += (node.velocity_new - node.velocity)*w;
+						//Velocity gradient
+						grad += node.velocity_new.outer_product(stencil.gradient(idx));
+						//VISUALIZATION ONLY: Update density
+						density += w * node.mass;
+					}
 				}
 			}
 		}
 		//Final velocity is a linear combination of PIC and FLIP components
-		p.velocity = flip*FLIP_PERCENT + pic*(1-FLIP_PERCENT);
+		obj->velocity[i] = flip*FLIP_PERCENT + pic*(1-FLIP_PERCENT);
 		//VISUALIZATION: Update density
-		p.density /= node_area;
+		density /= node_area;
 	}
-	collisionParticles();
+	//Particles in this range are still in cache
+	collisionParticles(begin, end, thread);
 }
-
-void Grid::collisionGrid(){
-	Vector2f delta_scale = Vector2f(TIMESTEP);
-	delta_scale /= cellsize;
-	for (int y=0, idx=0; y<size[1]; y++){
-		for (int x=0; x<size[0]; x++, idx++){
-			//Get grid node (equivalent to (y*size[0] + x))
-			GridNode &node = nodes[idx];
-			//Check to see if this node needs to be computed
-			if (node.active){
-				//Collision response
-				//TODO: make this work for arbitrary collision geometry
-				Vector2f new_pos = node.velocity_new*delta_scale + Vector2f(x, y);
-				//Left border, right border
-				if (new_pos[0] < BSPLINE_RADIUS || new_pos[0] > size[0]-BSPLINE_RADIUS-1){
-					node.velocity_new[0] = 0;
-					node.velocity_new[1] *= STICKY;
-				}
-				//Bottom border, top border
-				if (new_pos[1] < BSPLINE_RADIUS || new_pos[1] > size[1]-BSPLINE_RADIUS-1){
-					node.velocity_new[0] *= STICKY;
-					node.velocity_new[1] = 0;
+//MLS-MPM version of updateVelocities; particles take the grid velocity directly,
+//and the velocity gradient doubles as the affine matrix (C) for the next step
+template<int mode>
+void Grid::gatherAffine(int begin, int end, int thread) const{
+	for (int i=begin; i<end; i++){
+		Vector2f velocity;
+		Matrix2f affine;
+		float& density = obj->density[i];
+		density = 0;
+		
+		float gx = obj->grid_position[i][0],
+			gy = obj->grid_position[i][1];
+		int ox = GridKernel::first(gx), oy = GridKernel::first(gy);
+		if (simd != NULL){
+			SimdStencil<mode> stencil(this, simd, i, false);
+			simd->gatherAffine(&nodes[(int) (oy*size[0]+ox)], size[0], stencil.weights, obj->grid_position[i],
+				velocity, affine, density);
+		}
+		else{
+			Stencil<mode> stencil(this, i);
+			for (int idx=0, y=oy, y_end=y+GridKernel::SIZE; y<y_end; y++){
+				for (int x=ox, x_end=x+GridKernel::SIZE; x<x_end; x++, idx++){
+					float w = stencil.weight(idx);
+					if (w > BSPLINE_EPSILON){
+						const GridNode &node = nodes[(int) (y*size[0]+x)];
+						Vector2f node_vel = node.velocity_new*w;
+						velocity += node_vel;
+						affine += node_vel.outer_product(Vector2f(x-gx, y-gy));
+						//VISUALIZATION ONLY: Update density
+						density += w * node.mass;
+					}
 				}
 			}
 		}
+		//C = B*D^-1; the cellsize converts the offsets back to world units
+		affine *= GridKernel::invInertia();
+		affine.diag_product_inv(cellsize);
+		obj->velocity[i] = velocity;
+		obj->velocity_gradient[i] = affine;
+		density /= node_area;
+	}
+	collisionParticles(begin, end, thread);
+}
+
+void Grid::collisionGrid(){
+	updateNodes<&Grid::collisionNode>();
+}
+void Grid::collisionNode(int idx, int x, int y){
+	//Get grid node (equivalent to (y*size[0] + x))
+	GridNode &node = nodes[idx];
+	//Check to see if this node needs to be computed
+	if (node.active){
+		//Collision response
+		//TODO: make this work for arbitrary collision geometry
+		Vector2f delta_scale = Vector2f(TIMESTEP);
+		delta_scale /= cellsize;
+		Vector2f new_pos = node.velocity_new*delta_scale + Vector2f(x, y);
+		//Nodes within the kernel radius of the grid edge act as walls
+		float border = GridKernel::radius();
+		//Left border, right border
+		if (new_pos[0] < border || new_pos[0] > size[0]-border-1){
+			node.velocity_new[0] = 0;
+			node.velocity_new[1] *= STICKY;
+		}
+		//Bottom border, top border
+		if (new_pos[1] < border || new_pos[1] > size[1]-border-1){
+			node.velocity_new[0] *= STICKY;
+			node.velocity_new[1] = 0;
+		}
 	}
 }
 void Grid::collisionParticles() const{
-	for (int i=0; i<obj->size; i++){
-		Particle& p = obj->particles[i];
-		Vector2f new_pos = p.grid_position + TIMESTEP*p.velocity/cellsize;
+	ThreadPool::shared()->run<Grid, &Grid::collisionParticles>(this, obj->size);
+}
+void Grid::collisionParticles(int begin, int end, int /*thread*/) const{
+	for (int i=begin; i<end; i++){
+		Vector2f& velocity = obj->velocity[i];
+		Vector2f new_pos = obj->grid_position[i] + TIMESTEP*velocity/cellsize;
+		//Particles bounce one cell inside the grid walls, so their stencil stays inside the grid
+		float border = GridKernel::radius()-1;
 		//Left border, right border
-		if (new_pos[0] < BSPLINE_RADIUS-1 || new_pos[0] > size[0]-BSPLINE_RADIUS)
-			p.velocity[0] = -STICKY*p.velocity[0];
+		if (new_pos[0] < border || new_pos[0] > size[0]-border-1)
+			velocity[0] = -STICKY*velocity[0];
 		//Bottom border, top border
-		if (new_pos[1] < BSPLINE_RADIUS-1 || new_pos[1] > size[1]-BSPLINE_RADIUS)
-			p.velocity[1] = -STICKY*p.velocity[1];
+		if (new_pos[1] < border || new_pos[1] > size[1]-border-1)
+			velocity[1] = -STICKY*velocity[1];
 	}
 }
\ No newline at end of file
@@ -4,12 +4,56 @@
 #include <math.h>
 #include <cstring>
 #include <stdio.h>
+#include <vector>
+#include <algorithm>
 #include "PointCloud.h"
+#include "ThreadPool.h"
+#include "StencilSimd.h"
 #include "Vector2f.h"
 #include "SimConstants.h"
 
-const float BSPLINE_EPSILON = 1e-4;
-const int BSPLINE_RADIUS = 2;
+//Cells per side of a grid block; particles from two blocks of the same color
+//can't reach the same node, as long as this is at least GridKernel::SIZE-1
+const int GRID_BLOCK = 8;
+const int BLOCK_COLORS = 4;
+//Size of a particle's linearized stress (a 2x2 matrix for each velocity gradient entry)
+const int STRESS_DERIVATIVE = 16;
+
+//How particle interpolation weights are stored between grid transfers
+enum WeightMode{
+	WEIGHTS_CACHED,		//All weights and gradients for each particle (~200 bytes for cubic)
+	WEIGHTS_SEPARABLE,	//Weights and slopes along each axis (64 bytes for cubic)
+	WEIGHTS_RECOMPUTE	//Nothing; recompute them from grid_position in each kernel
+};
+//How velocities and forces are transferred between particles and grid
+enum TransferMode{
+	TRANSFER_FLIP,		//FLIP/PIC blend, with stress forces from weight gradients
+	TRANSFER_MLS		//Moving least squares MPM (APIC), no weight gradients needed
+};
+//How particles are reordered in memory, so particles next to each other in
+//the arrays also touch the same grid nodes
+enum SortMode{
+	SORT_NONE,			//Keep particles in the order they were created
+	SORT_FULL,			//Sort all particles by grid cell, in Z-order
+	SORT_INCREMENTAL	//Only sort the particles that are out of order, and merge them with the rest
+};
+//How the implicit system is solved (needs ENABLE_IMPLICIT)
+enum ImplicitSolver{
+	SOLVER_MATRIX_FREE,	//Conjugate residual, applying the system by going through the particles
+	SOLVER_CG,			//Assemble the system as a sparse matrix once per step, then conjugate gradient
+	SOLVER_BICGSTAB,	//Assembled, then BiCGSTAB
+	SOLVER_CHOLESKY		//Assembled, then a direct sparse LDL^T factorization (slower; for comparison)
+};
+//Preconditioner for the iterative solvers on the assembled system
+enum ImplicitPreconditioner{
+	PRECONDITIONER_DIAGONAL,	//Inverse of the matrix diagonal (Jacobi)
+	PRECONDITIONER_ILUT			//Incomplete LU factorization with thresholding (slower; for comparison)
+};
+//How the implicit velocity update integrates the stress (needs ENABLE_IMPLICIT)
+enum ImplicitIntegrator{
+	INTEGRATOR_SEMI_IMPLICIT,	//One linear solve, with the stress linearized at the start of the step
+	INTEGRATOR_OPTIMIZATION		//Backward Euler, minimizing the incremental potential with Newton's method
+};
 
 //Grid node data
 typedef struct GridNode{
@@ -18,17 +62,42 @@ typedef struct GridNode{
 	Vector2f velocity, velocity_new;
 	
 #if ENABLE_IMPLICIT
-	//All the following variables are used by the implicit linear solver
-	bool imp_active;	//are we still solving for vf
-	Vector2f force,
-		err,	//error of estimate
-		r,			//residual of estimate
-		p,			//residual gradient? squared residual?
-		Ep,	Er;		//yeah, I really don't know how this works...
-	float rEr;		//r.dot(Er)
+	//All the following variables are used by the implicit linear solve; the
+	//solution goes in velocity_new (see Grid::implicitVelocities)
+	Vector2f rhs,		//explicit velocity, which is the right hand side
+		force,			//delta force, from scattering the particles' delta stress
+		r,				//residual (of the system multiplied by mass)
+		z, Hz,			//preconditioned residual, and the system applied to it
+		p, Hp,			//search direction, and the system applied to it
+		q,				//preconditioned Hp
+		target,			//velocity without stress forces, for the optimization integrator
+		iterate, step;	//its current velocity, and the Newton step from there
+	//Node at a wall, whose velocity the optimization keeps at the collision response
+	bool fixed;
 #endif
 } GridNode;
 
+#if ENABLE_IMPLICIT
+//Neighbors of a node with an entry in the assembled system: every node a particle
+//can reach from it, so the matrix is exact
+const int SYSTEM_STENCIL = (2*GridKernel::SIZE-1)*(2*GridKernel::SIZE-1);
+//Entries the incomplete LU drops (relative to their row), and how much fill it keeps
+//(relative to the matrix)
+const float ILUT_DROP_TOLERANCE = 1e-3;
+const int ILUT_FILL_FACTOR = 2;
+//The optimization integrator's line search halves the Newton step until the potential
+//drops by at least this fraction of what the gradient predicts, at most LINE_SEARCH_STEPS times
+const float LINE_SEARCH_DECREASE = 1e-4;
+const int LINE_SEARCH_STEPS = 10;
+//Each Newton step's linear solve only brings its residual down as far as the gradient
+//has come down (relative to m*v*), capped at MAX_NEWTON_FORCING; tighter solves don't
+//make the Newton iterations converge any faster until they are close
+const float MAX_NEWTON_FORCING = .5;
+//Particles in each partial sum of the trial energy; the sums are added in order, so the
+//potential doesn't depend on the threads
+const int ENERGY_CHUNK = 256;
+#endif
+
 class Grid {
 public:
 	Vector2f origin, size, cellsize;
@@ -38,21 +107,57 @@ public:
 	int nodes_length;
 	GridNode* nodes;
 	
+	//Particles binned by grid block, so they can be scattered to the grid in parallel
+	int blocks_x, blocks_y;
+	//Block of each particle, and particle indices sorted by block
+	std::vector<int> particle_block, block_start, block_particles;
+	//Scratch space for the counting sort (one set of counts per thread)
+	std::vector<int> bin_offsets;
+	std::vector<int> color_blocks[BLOCK_COLORS];
+	//Blocks whose nodes can be reached by a particle; all nodes outside
+	//these blocks are zero, so grid passes only need to visit these
+	std::vector<int> active_blocks;
+	std::vector<char> block_occupied;
+	//Can be changed between timesteps
+	WeightMode weight_mode;
+	TransferMode transfer_mode;
+	SortMode sort_mode;
+	//Steps between particle sorts
+	int sort_interval;
+	//Instruction set for the stencil and plasticity loops; capped at what the CPU supports
+	SimdLevel simd_level;
+#if ENABLE_IMPLICIT
+	//Matrix-free or assembled solve, and the assembled solvers' preconditioner
+	ImplicitSolver implicit_solver;
+	ImplicitPreconditioner implicit_preconditioner;
+	//Iterations of the implicit solve so far (zero for the direct one), for profiling
+	int implicit_iterations;
+	//Semi-implicit or optimization-based update, and the optimization's Newton
+	//iterations so far (each one is a linear solve), for profiling
+	ImplicitIntegrator implicit_integrator;
+	int newton_iterations;
+#endif
+	
 	//Grid be at least one cell; there must be one layer of cells surrounding all particles
 	Grid(Vector2f pos, Vector2f dims, Vector2f cells, PointCloud* obj);
 	Grid(const Grid& orig);
 	virtual ~Grid();
 
-	//Map particles to grid
+	//Reorder particles by grid cell, if sort_interval steps have passed since the last sort
+	void sortParticles();
+	//Map particle mass to grid (first timestep only)
 	void initializeMass();
-	void initializeVelocities();
+	//Map particle mass, velocity and stress forces to grid
+	void initializeGrid();
 	//Map grid volumes back to particles (first timestep only)
 	void calculateVolumes() const;
 	//Compute grid velocities
 	void explicitVelocities(const Vector2f& gravity);
 #if ENABLE_IMPLICIT
+	//Solve for implicit velocities, starting from the explicit ones
 	void implicitVelocities();
-	void recomputeImplicitForces();
+	//Find them by minimizing the incremental potential instead (see INTEGRATOR_OPTIMIZATION)
+	void optimizeVelocities();
 #endif
 	//Map grid velocities back to particles
 	void updateVelocities() const;
@@ -61,30 +166,146 @@ public:
 	void collisionGrid();
 	void collisionParticles() const;
 	
-	//Cubic B-spline shape/basis/interpolation function
-	//A smooth curve from (0,1) to (1,0)
-	static float bspline(float x){
-		x = fabs(x);
-		float w;
-		if (x < 1)
-			w = x*x*(x/2 - 1) + 2/3.0;
-		else if (x < 2)
-			w = x*(x*(-x/6 + 1) - 2) + 4/3.0;
-		else return 0;
-		//Clamp between 0 and 1... if needed
-		if (w < BSPLINE_EPSILON) return 0;
-		return w;
+	//Parallel pieces of the above; these process a range of particles or nodes
+	//Those templated on the weight mode are dispatched using weight_mode
+	template<int mode> void computeWeights(int begin, int end, int thread);
+	void clearBlocks(int begin, int end, int thread);
+	template<int mode> void calculateVolumes(int begin, int end, int thread) const;
+	template<int mode> void updateVelocities(int begin, int end, int thread) const;
+	template<int mode> void gatherAffine(int begin, int end, int thread) const;
+	void collisionParticles(int begin, int end, int thread) const;
+	//Scatter a single particle's data to the grid
+	template<int mode> void scatterMass(int i);
+	template<int mode> void scatterParticle(int i);
+	template<int mode> void scatterAffine(int i);
+	//Run a scatter kernel for all particles; in parallel, if we have multiple threads
+	template<void (Grid::*kernel)(int)> void scatter();
+	template<void (Grid::*kernel)(int)> void scatterBlocks(int begin, int end, int thread);
+	//Update a single grid node; (x, y) is its grid coordinate
+	void explicitNode(int idx, int x, int y);
+	void affineNode(int idx, int x, int y);
+	void collisionNode(int idx, int x, int y);
+	//Run a node kernel for all nodes in the active blocks
+	template<void (Grid::*kernel)(int, int, int)> void updateNodes();
+	template<void (Grid::*kernel)(int, int, int)> void updateBlocks(int begin, int end, int thread);
+#if ENABLE_IMPLICIT
+	//Pieces of the implicit solve; the node kernels that return a value are summed
+	//over the grid with reduceNodes
+	void implicitOperator();
+	void linearizeStress(int begin, int end, int thread);
+	template<int mode> void gatherDeltaStress(int begin, int end, int thread);
+	template<int mode> void scatterDeltaForce(int i);
+	double implicitStartNode(int idx, int x, int y);
+	double implicitResidualNode(int idx, int x, int y);
+	double implicitOperatorNode(int idx, int x, int y);
+	void implicitDirectionNode(int idx, int x, int y);
+	double implicitStepNode(int idx, int x, int y);
+	void implicitFinishNode(int idx, int x, int y);
+	//Mass preconditioner; applying it sets out = in/m on each node, and returns the
+	//sum of in.dot(out)
+	template<Vector2f GridNode::*in, Vector2f GridNode::*out> double precondition();
+	template<Vector2f GridNode::*in, Vector2f GridNode::*out> double preconditionNode(int idx, int x, int y);
+	//The solve itself, matrix-free or with an Eigen sparse matrix assembled from the
+	//particles (see ImplicitSolver); they start from, and leave the solution in, the nodes,
+	//and stop once the residual has come down by tolerance
+	void solveSystem(double rhs_norm, float tolerance);
+	void solveMatrixFree(double rhs_norm, float tolerance);
+	void solveAssembled(float tolerance);
+	template<int mode> void assembleMatrix(int i);
+	int nodeSlot(int x, int y) const;
+	int systemColumn(int x, int y) const;
+	//Pieces of the optimization integrator; incrementalPotential evaluates the potential
+	//(and its gradient) a fraction alpha along the Newton step
+	double incrementalPotential(float alpha);
+	template<int mode> void gatherTrialStress(int begin, int end, int thread);
+	double newtonStartNode(int idx, int x, int y);
+	double newtonPotentialNode(int idx, int x, int y);
+	double newtonGradientNode(int idx, int x, int y);
+	double newtonSlopeNode(int idx, int x, int y);
+	double newtonDescentNode(int idx, int x, int y);
+	void newtonStepNode(int idx, int x, int y);
+	void newtonFinishNode(int idx, int x, int y);
+	//Sum a node kernel over the nodes in the active blocks
+	template<double (Grid::*kernel)(int, int, int)> double reduceNodes();
+	template<double (Grid::*kernel)(int, int, int)> void reduceBlocks(int begin, int end, int thread);
+#endif
+	//Clear the grid and compute particle weights, before scattering
+	void prepareGrid();
+	//Build the list of active blocks from the particle positions
+	void findActiveBlocks();
+	//Sort particles by grid block
+	void binParticles();
+	void countBins(int begin, int end, int thread);
+	void placeBins(int begin, int end, int thread);
+	void computeSortKeys(int begin, int end, int thread);
+	
+	//Separable weights for a particle: PARTICLE_AXIS_WEIGHTS values, in the same layout
+	//as PointCloud::axis_weights; weight for stencil node (x, y) is axis[x]*axis[SIZE+y]
+	static void axisWeights(const Vector2f& grid_position, float* axis){
+		const int n = GridKernel::SIZE;
+		float ox = grid_position[0], oy = grid_position[1];
+		for (int j=0, x=GridKernel::first(ox), y=GridKernel::first(oy); j<n; j++, x++, y++){
+			axis[j] = GridKernel::weight(ox-x);
+			axis[n+j] = GridKernel::weight(oy-y);
+			axis[2*n+j] = GridKernel::slope(ox-x);
+			axis[3*n+j] = GridKernel::slope(oy-y);
+		}
 	}
-	//Slope of interpolation function
-	static float bsplineSlope(float x){
-		float abs_x = fabs(x), w;
-		if (abs_x < 1)
-			return 1.5*x*abs_x - 2*x;
-		else if (x < 2)
-			return -x*abs_x/2 + 2*x - 2*x/abs_x;
-		else return 0;
-		//Clamp between -2/3 and 2/3... if needed
+	
+private:
+	//Get the range of nodes [start, end) covered by a block
+	void blockNodes(int block, int& x_start, int& x_end, int& y_start, int& y_end) const{
+		x_start = (block % blocks_x)*GRID_BLOCK;
+		y_start = (block / blocks_x)*GRID_BLOCK;
+		x_end = x_start+GRID_BLOCK < size[0] ? x_start+GRID_BLOCK : (int) size[0];
+		y_end = y_start+GRID_BLOCK < size[1] ? y_start+GRID_BLOCK : (int) size[1];
 	}
+	
+	//Vectorised kernels for simd_level, or NULL for the scalar loops
+	const SimdKernels* simd;
+	//Block color currently being scattered
+	int scatter_color;
+	//Z-order cell index of each particle in the high 32 bits, and its current index
+	//in the low 32 bits; sorting these gives the new particle order
+	std::vector<unsigned long long> sort_keys, sort_moved;
+	std::vector<int> sort_order;
+	int steps_since_sort;
+	//External force for integrateVelocities
+	Vector2f gravity;
+#if ENABLE_IMPLICIT
+	//Sum for each active block, from reduceNodes; they are added up in block
+	//order, so the solve doesn't depend on the number of threads
+	std::vector<double> block_sums;
+	//Velocity change (vf - v*) of each node in the last implicit solve, which is
+	//the initial guess for the next one; only valid in the blocks marked in block_solved
+	Vector2fArray implicit_guess;
+	std::vector<char> block_solved;
+	//Delta stress of each particle, for the current implicit operator
+	Matrix2fArray delta_stress;
+	//Delta stress is linear in the particle's velocity gradient, so for each particle we
+	//keep the delta stress of each gradient entry: STRESS_DERIVATIVE floats per particle
+	FloatArray stress_derivative;
+	//Step sizes of the current conjugate residual iteration
+	float implicit_alpha, implicit_beta;
+	//Scale of the stiffness in the system: IMPLICIT_RATIO*dt for the semi-implicit update,
+	//and dt for the optimization, whose system is the Hessian of the potential
+	float stiffness_scale;
+	//Deformation gradient each particle would have at the optimization's current trial
+	//velocities, with its polar decomposition, and the elastic energy there, summed
+	//over each ENERGY_CHUNK particles
+	Matrix2fArray trial_elastic, trial_rotation, trial_stretch;
+	std::vector<double> energy_sums;
+	//Fraction of the Newton step the trial velocities are at
+	float newton_alpha;
+	//The assembled system's arrays for the grid nodes only cover the active blocks; this
+	//is the slot of each block in them, or -1
+	std::vector<int> block_slot;
+	//Blocks of the assembled system for each node (SYSTEM_STENCIL of them, each a 2x2
+	//block stored [column][row]), the index of each node in the matrix (by slot), or
+	//-1, and the grid index of each unknown
+	FloatArray system_blocks;
+	std::vector<int> node_unknown, system_order;
+#endif
 };
 
 #endif
\ No newline at end of file
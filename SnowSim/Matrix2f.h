@@ -22,7 +22,7 @@ public:
 	Matrix2f(float i11, float i12, float i21, float i22);
 	Matrix2f(const Matrix2f& m);
 	Matrix2f(float data[2][2]);
-	virtual ~Matrix2f();
+	~Matrix2f();
 	static Matrix2f identity(){
 		return Matrix2f(1, 0, 0, 1);
 	}
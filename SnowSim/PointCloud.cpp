@@ -1,48 +1,309 @@
 #include "PointCloud.h"
+#include "StencilSimd.h"
 
-PointCloud::PointCloud(){}
+PointCloud::PointCloud(){
+	size = 0;
+	max_velocity = 0;
+	simd = NULL;
+}
 PointCloud::PointCloud(int cloud_size){
-	size = cloud_size;
-	particles.reserve(size);
+	size = 0;
+	max_velocity = 0;
+	simd = NULL;
+	volume.reserve(cloud_size);
+	mass.reserve(cloud_size);
+	density.reserve(cloud_size);
+	position.reserve(cloud_size);
+	velocity.reserve(cloud_size);
+	velocity_gradient.reserve(cloud_size);
+	lambda.reserve(cloud_size);
+	mu.reserve(cloud_size);
+	def_elastic.reserve(cloud_size);
+	def_plastic.reserve(cloud_size);
+	svd_w.reserve(cloud_size);
+	svd_v.reserve(cloud_size);
+	svd_e.reserve(cloud_size);
+	polar_r.reserve(cloud_size);
+	polar_s.reserve(cloud_size);
+	grid_position.reserve(cloud_size);
 }
 PointCloud::PointCloud(const PointCloud& orig){}
 PointCloud::~PointCloud(){}
 
+void PointCloud::addParticle(const Vector2f& pos, const Vector2f& vel, float mass, float lame_lambda, float lame_mu){
+	size++;
+	//Volume and density are estimated from the grid, before the simulation starts
+	volume.push_back(0);
+	this->mass.push_back(mass);
+	density.push_back(0);
+	position.push_back(pos);
+	velocity.push_back(vel);
+	velocity_gradient.push_back(Matrix2f());
+	lambda.push_back(lame_lambda);
+	mu.push_back(lame_mu);
+	//To start out with, we assume the deformation gradient is zero
+	//Or in other words, all particle velocities are the same
+	def_elastic.push_back(Matrix2f::identity());
+	def_plastic.push_back(Matrix2f::identity());
+	svd_e.push_back(Vector2f(1, 1));
+	svd_w.push_back(Matrix2f::identity());
+	svd_v.push_back(Matrix2f::identity());
+	polar_r.push_back(Matrix2f::identity());
+	polar_s.push_back(Matrix2f::identity());
+	grid_position.push_back(Vector2f());
+}
+
 void PointCloud::scale(Vector2f origin, Vector2f scale){
 	for (int i=0; i<size; i++){
 		for (int j=0; j<2; j++){
-			particles[i].position[j] = origin[j] + (particles[i].position[j]-origin[j])*scale[j];
+			position[i][j] = origin[j] + (position[i][j]-origin[j])*scale[j];
 		}
 	}
 }
 void PointCloud::translate(Vector2f off){
 	for (int i=0; i<size; i++){
-		particles[i].position[0] += off[0];
-		particles[i].position[1] += off[1];
+		position[i][0] += off[0];
+		position[i][1] += off[1];
 	}
 }
 void PointCloud::update(){
+	ThreadPool* pool = ThreadPool::shared();
+	int stride = CACHE_LINE/sizeof(float);
+	thread_max_velocity.assign(pool->size()*stride, 0);
+	pool->run<PointCloud, &PointCloud::update>(this, size);
+	//Reduce each thread's max velocity
 	max_velocity = 0;
-	for (int i=0; i<size; i++){
-		particles[i].updatePos();
-		particles[i].updateGradient();
-		particles[i].applyPlasticity();
+	for (int t=0, len=pool->size(); t<len; t++){
+		if (thread_max_velocity[t*stride] > max_velocity)
+			max_velocity = thread_max_velocity[t*stride];
+	}
+}
+void PointCloud::update(int begin, int end, int thread){
+	float& thread_max = thread_max_velocity[thread*CACHE_LINE/sizeof(float)];
+	float max_vel = thread_max;
+	int i = begin;
+	//Plasticity is done SIMD_PARTICLES at a time, if we can; the rest one by one
+	if (simd != NULL){
+		for (; i+SIMD_PARTICLES <= end; i+=SIMD_PARTICLES){
+			for (int j=i; j<i+SIMD_PARTICLES; j++){
+				updatePos(j);
+				updateGradient(j);
+			}
+			simd->applyPlasticity(this, i);
+			for (int j=i; j<i+SIMD_PARTICLES; j++){
+				float vel = velocity[j].length_squared();
+				if (vel > max_vel)
+					max_vel = vel;
+			}
+		}
+	}
+	for (; i<end; i++){
+		updatePos(i);
+		updateGradient(i);
+		applyPlasticity(i);
 		//Update max velocity, if needed
-		float vel = particles[i].velocity.length_squared();
-		if (vel > max_velocity)
-			max_velocity = vel;
+		float vel = velocity[i].length_squared();
+		if (vel > max_vel)
+			max_vel = vel;
+	}
+	thread_max = max_vel;
+}
+
+void PointCloud::updatePos(int i){
+	//Simple euler integration
+	position[i] += TIMESTEP*velocity[i];
+}
+void PointCloud::updateGradient(int i){
+	//So, initially we make all updates elastic
+	//velocity_gradient is left untouched, since MLS transfers need it in the next step
+	Matrix2f vel_grad = velocity_gradient[i]*TIMESTEP;
+	vel_grad.diag_sum(1);
+	def_elastic[i].setData(vel_grad * def_elastic[i]);
+}
+void PointCloud::applyPlasticity(int i){
+	Matrix2f &fe = def_elastic[i], &fp = def_plastic[i],
+		&w = svd_w[i], &v = svd_v[i];
+	Vector2f& e = svd_e[i];
+	Matrix2f f_all = fe * fp;
+	//We compute the SVD decomposition
+	//The singular values (basically a scale transform) tell us if 
+	//the particle has exceeded critical stretch/compression
+	fe.svd(&w, &e, &v);
+	Matrix2f svd_v_trans = v.transpose();
+	//Clamp singular values to within elastic region
+	for (int j=0; j<2; j++){
+		if (e[j] < CRIT_COMPRESS)
+			e[j] = CRIT_COMPRESS;
+		else if (e[j] > CRIT_STRETCH)
+			e[j] = CRIT_STRETCH;
 	}
+#if ENABLE_IMPLICIT
+	//Compute polar decomposition, from clamped SVD
+	polar_r[i].setData(w*svd_v_trans);
+	polar_s[i].setData(v);
+	polar_s[i].diag_product(e);
+	polar_s[i].setData(polar_s[i]*svd_v_trans);
+#endif
+	
+	//Recompute elastic and plastic gradient
+	//We're basically just putting the SVD back together again
+	Matrix2f v_cpy(v), w_cpy(w);
+	v_cpy.diag_product_inv(e);
+	w_cpy.diag_product(e);
+	fp = v_cpy*w.transpose()*f_all;
+	fe = w_cpy*v.transpose();
+}
+const Matrix2f PointCloud::energyDerivative(int i) const{
+	const Matrix2f &fe = def_elastic[i];
+	//Adjust lame parameters to account for hardening
+	float harden = exp(HARDENING*(1-def_plastic[i].determinant())),
+		Je = svd_e[i].product();
+	//This is the co-rotational term
+	Matrix2f temp = 2*mu[i]*(fe - svd_w[i]*svd_v[i].transpose())*fe.transpose();
+	//Add in the primary contour term
+	temp.diag_sum(lambda[i]*Je*(Je-1));
+	//Add hardening and volume
+	return volume[i] * harden * temp;
+}
+#if ENABLE_IMPLICIT
+const Matrix2f PointCloud::deltaStress(int i, const Matrix2f& del_velocity) const{
+	return deltaStress(i, del_velocity, def_elastic[i], polar_r[i], polar_s[i]);
+}
+const Matrix2f PointCloud::deltaStress(int i, const Matrix2f& del_velocity, const Matrix2f& fe, const Matrix2f& pr, const Matrix2f& ps) const{
+	//For detailed explanation, check out the implicit math pdf for details
+	//Before we do the force calculation, we need deltaF, deltaR, and delta(JF^-T)
+	
+	//Finds delta(Fe), where Fe is the elastic deformation gradient; del_velocity
+	//is the sum of u*grad(w) over the particle's stencil, and it acts on the gradient
+	//from the start of the step, whichever fe we linearize around
+	Matrix2f del_elastic = TIMESTEP*del_velocity*def_elastic[i];
+	//This has to stay linear in del_velocity for the conjugate residual solve to
+	//converge, so there is no shortcut for small changes
+
+	//Compute R^T*dF - dF^TR
+	//It is skew symmetric, so we only need to compute one value (three for 3D)
+	//Matrices are indexed [column][row], so this is the top right entry
+	float y = (pr[0][0]*del_elastic[1][0] + pr[0][1]*del_elastic[1][1]) -
+				(pr[1][0]*del_elastic[0][0] + pr[1][1]*del_elastic[0][1]);
+	//Next we need to compute MS + SM, where S is the hermitian matrix (symmetric for real
+	//valued matrices) of the polar decomposition and M is (R^T*dR); This is equal
+	//to the matrix we just found (R^T*dF ...), so we set them equal to eachother
+	//Since everything is so symmetric, we get a nice system of linear equations
+	//once we multiply everything out. (see pdf for details)
+	//In the case of 2D, we only need to solve for one variable (three for 3D)
+	float x = y / (ps[0][0] + ps[1][1]);
+	//Final computation is deltaR = R*(R^T*dR)
+	Matrix2f del_rotate = Matrix2f(
+		-pr[1][0]*x, pr[0][0]*x,
+		-pr[1][1]*x, pr[0][1]*x
+	);
+	
+	//We need the cofactor matrix of F, JF^-T
+	Matrix2f cofactor = fe.cofactor();
+		
+	//The last matrix we need is delta(JF^-T)
+	//Instead of doing the complicated matrix derivative described in the paper
+	//we can just take the derivative of each individual entry in JF^-T; JF^-T is
+	//the cofactor matrix of F, so we'll just hardcode the whole thing
+	//For example, entry [0][0] for a 3x3 matrix is
+	//	cofactor = e*i - f*h
+	//	derivative = (e*Di + De*i) - (f*Dh + Df*h)
+	//	where the derivatives (capital D) come from our precomputed delta(F)
+	//In the case of 2D, this turns out to be just the cofactor of delta(F)
+	//For 3D, it will not be so simple
+	Matrix2f del_cofactor = del_elastic.cofactor();
+
+	//Calculate "A" as given by the paper
+	//Co-rotational term
+	Matrix2f Ap = del_elastic-del_rotate;
+	Ap *= 2*mu[i];
+	//Primary contour term
+	cofactor *= cofactor.frobeniusInnerProduct(del_elastic);
+	del_cofactor *= (fe.determinant()-1);
+	cofactor += del_cofactor;
+	cofactor *= lambda[i];
+	Ap += cofactor;
+	
+	//Put it all together; hardening scales the lame parameters, as in energyDerivative
+	float harden = exp(HARDENING*(1-def_plastic[i].determinant()));
+	return volume[i]*harden*(Ap*def_elastic[i].transpose());
 }
+float PointCloud::trialEnergy(int i, const Matrix2f& fe, Matrix2f& stress, Matrix2f& pr, Matrix2f& ps) const{
+	Matrix2f w, v;
+	Vector2f e;
+	fe.svd(&w, &e, &v);
+	Matrix2f svd_v_trans = v.transpose();
+	pr.setData(w*svd_v_trans);
+	ps.setData(v);
+	ps.diag_product(e);
+	ps.setData(ps*svd_v_trans);
+	//Same terms as energyDerivative: the co-rotational term is mu*|F-R|^2, and the
+	//primary contour term is lambda/2*(J-1)^2, whose derivative is lambda*(J-1)*JF^-T
+	float harden = exp(HARDENING*(1-def_plastic[i].determinant())),
+		Je = e.product();
+	Matrix2f corotated = fe - pr,
+		temp = 2*mu[i]*corotated + lambda[i]*(Je-1)*fe.cofactor();
+	stress.setData(volume[i]*harden*(temp*def_elastic[i].transpose()));
+	return volume[i]*harden*(mu[i]*corotated.frobeniusInnerProduct(corotated) + .5f*lambda[i]*(Je-1)*(Je-1));
+}
+#endif
+
+//Gather one particle attribute into its new order
+template<class T>
+static void permute(T& data, T& scratch, const int* order, int begin, int end){
+	scratch.resize(end-begin);
+	for (int i=begin; i<end; i++)
+		scratch[i-begin] = data[order[i-begin]];
+	std::copy(scratch.begin(), scratch.end(), data.begin()+begin);
+}
+void PointCloud::reorder(const int* order, int begin, int end){
+	FloatArray float_scratch;
+	Vector2fArray vector_scratch;
+	Matrix2fArray matrix_scratch;
+	permute(volume, float_scratch, order, begin, end);
+	permute(mass, float_scratch, order, begin, end);
+	permute(density, float_scratch, order, begin, end);
+	permute(lambda, float_scratch, order, begin, end);
+	permute(mu, float_scratch, order, begin, end);
+	permute(position, vector_scratch, order, begin, end);
+	permute(velocity, vector_scratch, order, begin, end);
+	permute(svd_e, vector_scratch, order, begin, end);
+	permute(velocity_gradient, matrix_scratch, order, begin, end);
+	permute(def_elastic, matrix_scratch, order, begin, end);
+	permute(def_plastic, matrix_scratch, order, begin, end);
+	permute(svd_w, matrix_scratch, order, begin, end);
+	permute(svd_v, matrix_scratch, order, begin, end);
+	permute(polar_r, matrix_scratch, order, begin, end);
+	permute(polar_s, matrix_scratch, order, begin, end);
+}
+
 void PointCloud::merge(const PointCloud& other){
 	size += other.size;
-	particles.reserve(size);
-	particles.insert(particles.end(), other.particles.begin(), other.particles.end());
+	if (other.max_velocity > max_velocity)
+		max_velocity = other.max_velocity;
+	volume.insert(volume.end(), other.volume.begin(), other.volume.end());
+	mass.insert(mass.end(), other.mass.begin(), other.mass.end());
+	density.insert(density.end(), other.density.begin(), other.density.end());
+	position.insert(position.end(), other.position.begin(), other.position.end());
+	velocity.insert(velocity.end(), other.velocity.begin(), other.velocity.end());
+	velocity_gradient.insert(velocity_gradient.end(), other.velocity_gradient.begin(), other.velocity_gradient.end());
+	lambda.insert(lambda.end(), other.lambda.begin(), other.lambda.end());
+	mu.insert(mu.end(), other.mu.begin(), other.mu.end());
+	def_elastic.insert(def_elastic.end(), other.def_elastic.begin(), other.def_elastic.end());
+	def_plastic.insert(def_plastic.end(), other.def_plastic.begin(), other.def_plastic.end());
+	svd_w.insert(svd_w.end(), other.svd_w.begin(), other.svd_w.end());
+	svd_v.insert(svd_v.end(), other.svd_v.begin(), other.svd_v.end());
+	svd_e.insert(svd_e.end(), other.svd_e.begin(), other.svd_e.end());
+	polar_r.insert(polar_r.end(), other.polar_r.begin(), other.polar_r.end());
+	polar_s.insert(polar_s.end(), other.polar_s.begin(), other.polar_s.end());
+	grid_position.insert(grid_position.end(), other.grid_position.begin(), other.grid_position.end());
+	//Interpolation weights are recomputed by the grid
 }
 void PointCloud::bounds(float bounds[4]){
-	bounds[0] = particles[0].position[0]; bounds[1] = bounds[0];
-	bounds[2] = particles[0].position[1]; bounds[3] = bounds[2];
+	bounds[0] = position[0][0]; bounds[1] = bounds[0];
+	bounds[2] = position[0][1]; bounds[3] = bounds[2];
 	for (int i=0; i<size; i++){
-		Vector2f &p = particles[i].position;
+		Vector2f &p = position[i];
 		//X-bounds
 		if (p[0] < bounds[0])
 			bounds[0] = p[0];
@@ -55,3 +316,14 @@ void PointCloud::bounds(float bounds[4]){
 			bounds[3] = p[1];
 	}
 }
+int PointCloud::particleBytes() const{
+	if (size == 0)
+		return 0;
+	long bytes = sizeof(float)*(volume.size() + mass.size() + density.size() +
+			lambda.size() + mu.size() + weights.size() + axis_weights.size()) +
+		sizeof(Vector2f)*(position.size() + velocity.size() + svd_e.size() +
+			grid_position.size() + weight_gradient.size()) +
+		sizeof(Matrix2f)*(velocity_gradient.size() + def_elastic.size() + def_plastic.size() +
+			svd_w.size() + svd_v.size() + polar_r.size() + polar_s.size());
+	return bytes/size;
+}
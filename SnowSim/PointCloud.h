@@ -2,37 +2,108 @@
 #define	OBJECT_H
 
 #include <vector>
+#include <algorithm>
+#include <cmath>
 #include "SimConstants.h"
-#include "Particle.h"
+#include "Vector2f.h"
+#include "Matrix2f.h"
 #include "Shape.h"
+#include "AlignedAllocator.h"
+#include "ThreadPool.h"
+#include "BSpline.h"
 
 #define AREA_EPSILON 1e-5
+//Number of grid nodes each particle interpolates to
+#define PARTICLE_STENCIL (GridKernel::SIZE*GridKernel::SIZE)
+//Separable weights for each particle: one weight and slope per axis, for each node along it
+#define PARTICLE_AXIS_WEIGHTS (4*GridKernel::SIZE)
+
+//Contiguous, cache aligned storage for one particle attribute
+typedef std::vector<float, AlignedAllocator<float> > FloatArray;
+typedef std::vector<Vector2f, AlignedAllocator<Vector2f> > Vector2fArray;
+typedef std::vector<Matrix2f, AlignedAllocator<Matrix2f> > Matrix2fArray;
+
+struct SimdKernels;
 
 inline float random_number(float lo, float hi){
 	return lo + rand() / (float) (RAND_MAX/(hi-lo));
 }
 
+//Particles are stored as a structure of arrays (one array per attribute),
+//so each grid transfer only streams the attributes it actually uses
 class PointCloud {
 public:
 	int size;
 	float max_velocity;
-	std::vector<Particle> particles;
+	
+	FloatArray volume, mass, density;
+	Vector2fArray position, velocity;
+	//Also used as the affine velocity matrix, for MLS transfers
+	Matrix2fArray velocity_gradient;
+	//Lame parameters (_s denotes starting configuration)
+	FloatArray lambda, mu;
+	//Deformation gradient (elastic and plastic parts)
+	Matrix2fArray def_elastic, def_plastic;
+	//Cached SVD's for elastic deformation gradient
+	Matrix2fArray svd_w, svd_v;
+	Vector2fArray svd_e;
+	//Cached polar decomposition
+	Matrix2fArray polar_r, polar_s;
+	//Grid interpolation weights; which of these are used depends on the grid's
+	//weight mode (see Grid.h), and the grid allocates them as needed
+	Vector2fArray grid_position;
+	//PARTICLE_STENCIL entries per particle
+	Vector2fArray weight_gradient;
+	FloatArray weights;
+	//PARTICLE_AXIS_WEIGHTS entries per particle: x weights, y weights, x slopes, y slopes
+	FloatArray axis_weights;
+	//Vectorised kernels for update() (see StencilSimd.h), or NULL to do each
+	//particle on its own; the grid sets this from its simd_level
+	const SimdKernels* simd;
 
 	PointCloud();
 	PointCloud(int cloud_size);
 	PointCloud(const PointCloud& orig);
 	virtual ~PointCloud();
 	
+	//Add a particle to the end of the cloud
+	void addParticle(const Vector2f& pos, const Vector2f& vel, float mass, float lambda, float mu);
 	//Transform points in cloud
 	void scale(Vector2f origin, Vector2f scale);
 	void translate(Vector2f off);
 	//Update particle data
 	void update();
+	void update(int begin, int end, int thread);
 	
+	//Update position, based on velocity
+	void updatePos(int i);
+	//Update deformation gradient
+	void updateGradient(int i);
+	void applyPlasticity(int i);
+	//Compute stress tensor
+	const Matrix2f energyDerivative(int i) const;
+	//Computes the change in stress for a change in velocity gradient, for the implicit
+	//velocity update; it goes to the grid the same way as energyDerivative
+	const Matrix2f deltaStress(int i, const Matrix2f& del_velocity) const;
+	//The same, for a trial elastic deformation gradient fe (with polar decomposition
+	//pr*ps) reached from the current one during the step; the optimization integrator
+	//uses it for the Hessian of the incremental potential
+	const Matrix2f deltaStress(int i, const Matrix2f& del_velocity, const Matrix2f& fe, const Matrix2f& pr, const Matrix2f& ps) const;
+	//Elastic energy of a particle, if its elastic deformation gradient were fe; also gives
+	//the stress there (times the current gradient's transpose, so it goes to the grid like
+	//energyDerivative), and fe's polar decomposition pr*ps
+	float trialEnergy(int i, const Matrix2f& fe, Matrix2f& stress, Matrix2f& pr, Matrix2f& ps) const;
+	
+	//Move particle order[i-begin] to index i, for each i in [begin, end); order must
+	//be a permutation of [begin, end). Grid positions and interpolation weights are
+	//not moved, since the grid recomputes them every step
+	void reorder(const int* order, int begin, int end);
 	//Merge two point clouds
 	void merge(const PointCloud& other);
 	//Get bounding box [xmin, xmax, ymin, ymax]
 	void bounds(float bounds[4]);
+	//Bytes of storage currently used by each particle
+	int particleBytes() const;
 
 	//Generate particles that fill a set of shapes
 	static PointCloud* createShape(std::vector<Shape*>& snow_shapes, Vector2f velocity){
@@ -94,9 +165,7 @@ public:
 						//Make snow hardest on the outer edges
 						adjust *= ((fabs(tx-cx)/cw) + (fabs(ty-cy)/ch))/2.0;
 						//Add the snow particle
-						obj->particles.push_back(Particle(
-							Vector2f(tx, ty), Vector2f(velocity), particle_mass, lambda, mu
-						));						
+						obj->addParticle(Vector2f(tx, ty), velocity, particle_mass, lambda, mu);
 						points_found++;
 					}
 				}
@@ -107,6 +176,11 @@ public:
 		
 		return obj;
 	}
+
+private:
+	//Max velocity found by each thread in update(); padded so
+	//each thread writes to its own cache line
+	FloatArray thread_max_velocity;
 };
 
 #endif
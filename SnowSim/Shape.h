@@ -3,7 +3,9 @@
 
 #include <vector>
 #include <math.h>
+#ifndef HEADLESS
 #include "glfw3/glfw3.h"
+#endif
 #include "Vector2f.h"
 
 class Shape {
@@ -25,8 +27,13 @@ public:
 	//Bounding box for shape
 	void bounds(float bounds[4]);
 	
+#ifndef HEADLESS
 	void draw();
+#endif
 };
 
+//Approximate a circle with a polygon
+Shape* generateSnowball(Vector2f origin, float radius);
+
 #endif
 
@@ -15,10 +15,15 @@ static const float
 	DENSITY = 100,				//Density of snow in kg/m^2 (400 for 3d)
 	YOUNGS_MODULUS = 1.5e5,		//Young's modulus (springiness) (1.4e5)
 	POISSONS_RATIO = .2,		//Poisson's ratio (transverse/axial strain ratio) (.2)
-	IMPLICIT_RATIO = 0,			//Percentage that should be implicit vs explicit for velocity update
+	IMPLICIT_RATIO = 0,			//Percentage that should be implicit vs explicit for velocity update (needs ENABLE_IMPLICIT; IMPLICIT_CFL assumes 1)
 	MAX_IMPLICIT_ITERS = 30,	//Maximum iterations for the conjugate residual
-	MAX_IMPLICIT_ERR = 1e4,		//Maximum allowed error for conjugate residual
-	MIN_IMPLICIT_ERR = 1e-4,	//Minimum allowed error for conjugate residual
+	IMPLICIT_TOLERANCE = 1e-4,	//Residual (relative to v*) at which the conjugate residual stops
+	IMPLICIT_CFL = .2,			//Adaptive timestep adjustment, when the implicit solve is used
+	MAX_IMPLICIT_TIMESTEP = 2.5e-3,	//Upper timestep limit, when the implicit solve is used
+	MAX_NEWTON_ITERS = 10,		//Maximum Newton iterations for the optimization integrator
+	NEWTON_TOLERANCE = 1e-3,	//Gradient (relative to m*v*) at which the Newton iterations stop
+	OPTIMIZATION_CFL = .5,		//Adaptive timestep adjustment, for the optimization integrator
+	MAX_OPTIMIZATION_TIMESTEP = FRAMERATE,	//Upper timestep limit, for the optimization integrator
 	STICKY = .9,				//Collision stickiness (lower = stickier)
 	GRAVITY = -9.8;
 
@@ -40,6 +45,16 @@ static const float
 #define SCREENCAST false
 #define SCREENCAST_DIR "../screencast/"
 #define ENABLE_IMPLICIT false
+#define IMPLICIT_SOLVER SOLVER_MATRIX_FREE	//Matrix-free or assembled implicit solve (see Grid.h)
+#define IMPLICIT_PRECONDITIONER PRECONDITIONER_DIAGONAL	//Preconditioner for the assembled solve (see Grid.h)
+#define IMPLICIT_INTEGRATOR INTEGRATOR_SEMI_IMPLICIT	//Semi-implicit or optimization-based update (see Grid.h)
+#define NUM_THREADS 0			//Simulation threads (0 = one per core)
+#define WEIGHT_MODE WEIGHTS_CACHED	//How grid interpolation weights are stored (see Grid.h)
+#define TRANSFER_MODE TRANSFER_FLIP	//Particle/grid transfer scheme (see Grid.h)
+#define BSPLINE_KERNEL CubicBSpline	//Grid interpolation kernel: CubicBSpline or QuadraticBSpline
+#define SORT_MODE SORT_INCREMENTAL	//How particles are reordered for cache locality (see Grid.h)
+#define SORT_INTERVAL 10		//Steps between particle sorts
+#define SIMD_LEVEL SIMD_AUTO	//Instruction set for the stencil loops (see StencilSimd.h)
 
 #endif
 
@@ -0,0 +1,98 @@
+#include "Simulation.h"
+
+//Actual timestep is adaptive, based on grid resolution and max velocity
+float TIMESTEP;
+
+SimProfile::SimProfile(){
+	reset();
+}
+
+void SimProfile::reset(){
+	for (int i=0; i<NUM_PHASES; i++)
+		phase_time[i] = 0;
+	last = now();
+}
+void SimProfile::start(){
+	last = now();
+}
+void SimProfile::stop(SimPhase phase){
+	double cur = now();
+	phase_time[phase] += cur-last;
+	last = cur;
+}
+double SimProfile::total() const{
+	double sum = 0;
+	for (int i=0; i<NUM_PHASES; i++)
+		sum += phase_time[i];
+	return sum;
+}
+const char* SimProfile::phaseName(SimPhase phase){
+	switch (phase){
+		case PHASE_SORT: return "Sort";
+		case PHASE_P2G: return "P2G";
+		case PHASE_GRID: return "Grid update";
+		case PHASE_G2P: return "G2P";
+		case PHASE_PARTICLES: return "Particle update";
+		default: return "";
+	}
+}
+double SimProfile::now(){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+#if ENABLE_IMPLICIT
+//The implicit solve uses weight gradients, which MLS transfers don't have
+static bool implicit_update(const Grid* grid){
+	return grid->transfer_mode == TRANSFER_FLIP &&
+		(IMPLICIT_RATIO > 0 || grid->implicit_integrator == INTEGRATOR_OPTIMIZATION);
+}
+#endif
+
+float adaptive_timestep(const Grid* grid, const PointCloud* snow){
+	float cfl = CFL, max_timestep = MAX_TIMESTEP, max_vel = snow->max_velocity, f;
+#if ENABLE_IMPLICIT
+	//The implicit solve keeps stiff snow stable with larger steps; with the
+	//optimization, only the particles crossing too many cells limit them
+	if (implicit_update(grid)){
+		bool optimization = grid->implicit_integrator == INTEGRATOR_OPTIMIZATION;
+		cfl = optimization ? OPTIMIZATION_CFL : IMPLICIT_CFL;
+		max_timestep = optimization ? MAX_OPTIMIZATION_TIMESTEP : MAX_IMPLICIT_TIMESTEP;
+	}
+#endif
+	if (max_vel > 1e-8){
+		//We should really take the min(cellsize) I think, if the grid is not square
+		float dt = cfl * grid->cellsize[0]/sqrt(max_vel);
+		f = dt > FRAMERATE ? FRAMERATE : dt;
+	}
+	else f = FRAMERATE;
+	return f > max_timestep ? max_timestep : f;
+}
+
+float simulation_step(Grid* grid, PointCloud* snow, const Vector2f& gravity, SimProfile* profile){
+	TIMESTEP = adaptive_timestep(grid, snow);
+	if (profile) profile->start();
+	
+	//Keep particles that are close together in space close together in memory
+	grid->sortParticles();
+	if (profile) profile->stop(PHASE_SORT);
+	//Initialize FEM grid
+	grid->initializeGrid();
+	if (profile) profile->stop(PHASE_P2G);
+	//Compute grid velocities
+	grid->explicitVelocities(gravity);
+#if ENABLE_IMPLICIT
+	if (implicit_update(grid))
+		grid->implicitVelocities();
+#endif
+	if (profile) profile->stop(PHASE_GRID);
+	//Map back to particles
+	grid->updateVelocities();
+	if (profile) profile->stop(PHASE_G2P);
+	//Update particle data
+	snow->update();
+	if (profile) profile->stop(PHASE_PARTICLES);
+	
+	return TIMESTEP;
+}
@@ -0,0 +1,48 @@
+#ifndef SIMULATION_H
+#define	SIMULATION_H
+
+#include <time.h>
+#include "Grid.h"
+#include "PointCloud.h"
+#include "Vector2f.h"
+#include "SimConstants.h"
+
+//Phases of a simulation step (used for profiling)
+enum SimPhase{
+	PHASE_SORT,			//Reordering particles by grid cell
+	PHASE_P2G,			//Particle to grid transfer (mass and velocity)
+	PHASE_GRID,			//Grid force computation and velocity update
+	PHASE_G2P,			//Grid to particle transfer
+	PHASE_PARTICLES,	//Particle position, deformation and plasticity update
+	NUM_PHASES
+};
+
+//Accumulates wall clock time spent in each phase of the simulation
+class SimProfile {
+public:
+	double phase_time[NUM_PHASES];
+	
+	SimProfile();
+	
+	void reset();
+	//Start timing a new phase
+	void start();
+	//Adds time since the last start/stop to a phase
+	void stop(SimPhase phase);
+	//Sum of all phase times
+	double total() const;
+	
+	static const char* phaseName(SimPhase phase);
+	//Monotonic wall clock time, in seconds
+	static double now();
+private:
+	double last;
+};
+
+//Timestep based on grid resolution and max velocity (CFL condition)
+float adaptive_timestep(const Grid* grid, const PointCloud* snow);
+//Advance the simulation by one adaptive timestep; profile may be NULL
+//Returns the timestep that was taken
+float simulation_step(Grid* grid, PointCloud* snow, const Vector2f& gravity, SimProfile* profile);
+
+#endif
@@ -0,0 +1,85 @@
+#include "StencilSimd.h"
+#include <string.h>
+#include <immintrin.h>
+#include "Grid.h"
+
+//The kernels are compiled once for each instruction set; only the ones the
+//CPU supports are ever called, so one binary runs on any x86-64 machine.
+//Fused multiply-adds are turned off on purpose (AVX-512 would use them
+//otherwise): they round differently, and we want every machine to give the
+//same results
+#pragma GCC optimize("fp-contract=off")
+
+//The kernels are all static, so the vector ABI warnings don't apply
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+//Each block below also tells the kernels how wide a register is (SIMD_WIDTH floats),
+//and which intrinsic takes the square root of a whole register
+
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+#define SIMD_NAMESPACE simd_sse
+#define SIMD_LEVEL_NAME SIMD_SSE
+#define SIMD_REGISTER __m128
+#define SIMD_WIDTH 4
+#define SIMD_SQRT _mm_sqrt_ps
+#include "StencilKernels.inc"
+#undef SIMD_NAMESPACE
+#undef SIMD_LEVEL_NAME
+#undef SIMD_REGISTER
+#undef SIMD_WIDTH
+#undef SIMD_SQRT
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define SIMD_NAMESPACE simd_avx2
+#define SIMD_LEVEL_NAME SIMD_AVX2
+#define SIMD_REGISTER __m256
+#define SIMD_WIDTH 8
+#define SIMD_SQRT _mm256_sqrt_ps
+#include "StencilKernels.inc"
+#undef SIMD_NAMESPACE
+#undef SIMD_LEVEL_NAME
+#undef SIMD_REGISTER
+#undef SIMD_WIDTH
+#undef SIMD_SQRT
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define SIMD_NAMESPACE simd_avx512
+#define SIMD_LEVEL_NAME SIMD_AVX512
+#define SIMD_REGISTER __m512
+#define SIMD_WIDTH 16
+#define SIMD_SQRT _mm512_sqrt_ps
+#include "StencilKernels.inc"
+#undef SIMD_NAMESPACE
+#undef SIMD_LEVEL_NAME
+#undef SIMD_REGISTER
+#undef SIMD_WIDTH
+#undef SIMD_SQRT
+#pragma GCC pop_options
+
+SimdLevel simdSupported(){
+	//This also checks that the OS saves the wider registers
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return SIMD_AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return SIMD_SSE;
+	return SIMD_NONE;
+}
+const SimdKernels* simdKernels(SimdLevel level){
+	static const SimdLevel supported = simdSupported();
+	if (level > supported)
+		level = supported;
+	switch (level){
+		case SIMD_SSE: return &simd_sse::kernels;
+		case SIMD_AVX2: return &simd_avx2::kernels;
+		case SIMD_AVX512: return &simd_avx512::kernels;
+		default: return NULL;
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef STENCILSIMD_H
+#define	STENCILSIMD_H
+
+#include "Vector2f.h"
+#include "Matrix2f.h"
+
+struct GridNode;
+class PointCloud;
+
+//Instruction sets the vectorised kernels are built for
+enum SimdLevel{
+	SIMD_NONE,		//Plain scalar loops, one node at a time
+	SIMD_SSE,		//4 lanes: one row of the stencil at a time
+	SIMD_AVX2,		//8 lanes: two rows at a time
+	SIMD_AVX512,	//16 lanes: the whole stencil at once
+	SIMD_AUTO		//Best one the CPU supports
+};
+
+//Number of nodes the vectorised kernels work on; they are written for the 4x4
+//stencil of the cubic B-spline, so other kernels use the scalar loops
+#define SIMD_STENCIL 16
+//Number of particles the vectorised plasticity kernel works on at once
+#define SIMD_PARTICLES 16
+
+//Vectorised stencil kernels for one instruction set. Stencil weights and gradients
+//are in the same layout as PointCloud::weights and weight_gradient, and the stencil's
+//nodes start at row, with stride nodes between each row of the grid. Scatter
+//kernels add to the nodes exactly like the scalar loops do, so they give the same
+//results; gather kernels sum the stencil in a different order than the scalar loops,
+//but the same order for every instruction set.
+struct SimdKernels{
+	SimdLevel level;
+	//Separable weights for a particle at grid_position, in the layout of PointCloud::axis_weights
+	void (*axisWeights)(const Vector2f& grid_position, float* axis);
+	//Full stencil weights, and gradients if gradients isn't NULL, from separable weights
+	void (*stencilWeights)(const float* axis, const Vector2f& cellsize, float* weights, Vector2f* gradients);
+	//Grid::scatterMass, scatterParticle and scatterAffine, for one particle
+	void (*scatterMass)(GridNode* row, int stride, const float* weights, float mass);
+	void (*scatterParticle)(GridNode* row, int stride, const float* weights, const Vector2f* gradients,
+		float mass, const Vector2f& velocity, const Matrix2f& energy);
+	void (*scatterAffine)(GridNode* row, int stride, const float* weights, const Vector2f& grid_position,
+		float mass, const Vector2f& momentum, const Matrix2f& affine);
+	//Grid::updateVelocities and gatherAffine, for one particle; flip and density are
+	//sums of (new - old) grid velocity and mass, weighted
+	void (*gatherParticle)(const GridNode* row, int stride, const float* weights, const Vector2f* gradients,
+		Vector2f& pic, Vector2f& flip, Matrix2f& velocity_gradient, float& density);
+	void (*gatherAffine)(const GridNode* row, int stride, const float* weights, const Vector2f& grid_position,
+		Vector2f& velocity, Matrix2f& affine, float& density);
+	//PointCloud::applyPlasticity, for particles [begin, begin+SIMD_PARTICLES); gives
+	//exactly the same results, but without branches
+	void (*applyPlasticity)(PointCloud* obj, int begin);
+};
+
+//Best instruction set this CPU (and OS) supports
+SimdLevel simdSupported();
+//Kernels for an instruction set; if the CPU doesn't support it, the kernels for the
+//best one it does support. Returns NULL for SIMD_NONE
+const SimdKernels* simdKernels(SimdLevel level);
+
+#endif
@@ -0,0 +1,128 @@
+#include "ThreadPool.h"
+
+ThreadPool* ThreadPool::shared_pool = NULL;
+
+//Arguments passed to each worker thread
+struct WorkerArgs{
+	ThreadPool* pool;
+	int thread;
+};
+
+ThreadPool::ThreadPool(int num_threads){
+	if (num_threads <= 0)
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads <= 0)
+		num_threads = 1;
+	generation = 0;
+	busy = 0;
+	quit = false;
+	task = NULL;
+	data = NULL;
+	count = chunk = next = 0;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&start_cond, NULL);
+	pthread_cond_init(&done_cond, NULL);
+	//Calling thread is thread zero
+	workers.resize(num_threads-1);
+	for (int i=0; i<num_threads-1; i++){
+		WorkerArgs* args = new WorkerArgs;
+		args->pool = this;
+		args->thread = i+1;
+		pthread_create(&workers[i], NULL, worker, args);
+	}
+}
+ThreadPool::ThreadPool(const ThreadPool& /*orig*/){}
+ThreadPool::~ThreadPool(){
+	pthread_mutex_lock(&lock);
+	quit = true;
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&lock);
+	for (int i=0, len=workers.size(); i<len; i++)
+		pthread_join(workers[i], NULL);
+	pthread_cond_destroy(&start_cond);
+	pthread_cond_destroy(&done_cond);
+	pthread_mutex_destroy(&lock);
+}
+
+int ThreadPool::size() const{
+	return workers.size()+1;
+}
+void ThreadPool::run(ThreadTask task, void* data, int count, int chunk){
+	if (count <= 0)
+		return;
+	int threads = size();
+	//Small enough chunks that threads can balance the load
+	if (chunk <= 0)
+		chunk = count/(threads*8) + 1;
+	//Not worth waking up the workers
+	if (threads == 1 || count <= chunk){
+		task(data, 0, count, 0);
+		return;
+	}
+	
+	pthread_mutex_lock(&lock);
+	this->task = task;
+	this->data = data;
+	this->count = count;
+	this->chunk = chunk;
+	next = 0;
+	busy = workers.size();
+	generation++;
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&lock);
+	
+	process(0);
+	
+	//Wait for workers to finish their last chunk
+	pthread_mutex_lock(&lock);
+	while (busy > 0)
+		pthread_cond_wait(&done_cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+void* ThreadPool::worker(void* args){
+	WorkerArgs* worker_args = (WorkerArgs*) args;
+	ThreadPool* pool = worker_args->pool;
+	int thread = worker_args->thread;
+	delete worker_args;
+	pool->workerLoop(thread);
+	return NULL;
+}
+void ThreadPool::workerLoop(int thread){
+	unsigned int seen = 0;
+	pthread_mutex_lock(&lock);
+	while (true){
+		while (generation == seen && !quit)
+			pthread_cond_wait(&start_cond, &lock);
+		if (quit)
+			break;
+		seen = generation;
+		pthread_mutex_unlock(&lock);
+		
+		process(thread);
+		
+		pthread_mutex_lock(&lock);
+		if (--busy == 0)
+			pthread_cond_signal(&done_cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+void ThreadPool::process(int thread){
+	while (true){
+		int begin = __sync_fetch_and_add(&next, chunk);
+		if (begin >= count)
+			break;
+		int end = begin+chunk;
+		task(data, begin, end > count ? count : end, thread);
+	}
+}
+
+ThreadPool* ThreadPool::shared(){
+	if (shared_pool == NULL)
+		shared_pool = new ThreadPool(NUM_THREADS);
+	return shared_pool;
+}
+void ThreadPool::setSharedThreads(int num_threads){
+	delete shared_pool;
+	shared_pool = new ThreadPool(num_threads);
+}
@@ -0,0 +1,71 @@
+#ifndef THREADPOOL_H
+#define	THREADPOOL_H
+
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+#include "SimConstants.h"
+
+//Work item callback; processes items [begin, end) on the given thread (0 = calling thread)
+typedef void (*ThreadTask)(void* data, int begin, int end, int thread);
+
+//Persistent pool of worker threads for data parallel loops
+//The calling thread takes part in the work, so a pool of size 1 has no workers
+class ThreadPool {
+public:
+	ThreadPool(int num_threads);
+	virtual ~ThreadPool();
+	
+	//Number of threads that run tasks, including the calling thread
+	int size() const;
+	//Run task on items [0, count), handing out chunk items at a time (0 picks a chunk size);
+	//Blocks until all items are done. Tasks must not call run themselves
+	void run(ThreadTask task, void* data, int count, int chunk = 0);
+	//Same as above, but calls obj->method(begin, end, thread)
+	template<class T, void (T::*method)(int, int, int)>
+	void run(T* obj, int count, int chunk = 0){
+		run(&ThreadPool::invoke<T, method>, obj, count, chunk);
+	}
+	template<class T, void (T::*method)(int, int, int) const>
+	void run(const T* obj, int count, int chunk = 0){
+		run(&ThreadPool::invokeConst<T, method>, (void*) obj, count, chunk);
+	}
+	
+	//Pool shared by the simulation; created with NUM_THREADS threads on first use
+	static ThreadPool* shared();
+	//Recreate the shared pool with a different number of threads (0 = one per core)
+	static void setSharedThreads(int num_threads);
+private:
+	std::vector<pthread_t> workers;
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond, done_cond;
+	//Incremented for each new task, so workers know when to start
+	unsigned int generation;
+	int busy;
+	bool quit;
+	
+	//Current task
+	ThreadTask task;
+	void* data;
+	int count, chunk;
+	volatile int next;
+	
+	static ThreadPool* shared_pool;
+
+	ThreadPool(const ThreadPool& orig);
+	static void* worker(void* args);
+	void workerLoop(int thread);
+	//Process chunks of the current task until there are none left
+	void process(int thread);
+
+	template<class T, void (T::*method)(int, int, int)>
+	static void invoke(void* obj, int begin, int end, int thread){
+		(((T*) obj)->*method)(begin, end, thread);
+	}
+	template<class T, void (T::*method)(int, int, int) const>
+	static void invokeConst(void* obj, int begin, int end, int thread){
+		(((const T*) obj)->*method)(begin, end, thread);
+	}
+};
+
+#endif
@@ -15,7 +15,7 @@ public:
 	Vector2f(float val);
 	Vector2f(float x, float y);
 	Vector2f(const Vector2f& orig);
-	virtual ~Vector2f();
+	~Vector2f();
 	
 	//Operations
 	void setData(float val);
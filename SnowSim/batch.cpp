@@ -0,0 +1,462 @@
+#include "batch.h"
+
+using namespace std;
+
+static const char* WEIGHT_MODE_NAMES[] = {"cached", "separable", "recompute"};
+static const char* TRANSFER_MODE_NAMES[] = {"flip", "mls"};
+static const char* SORT_MODE_NAMES[] = {"none", "full", "incremental"};
+static const char* SIMD_LEVEL_NAMES[] = {"none", "sse", "avx2", "avx512", "auto"};
+static const char* IMPLICIT_SOLVER_NAMES[] = {"matrix-free", "cg", "bicgstab", "cholesky"};
+static const char* IMPLICIT_PRECONDITIONER_NAMES[] = {"diagonal", "ilut"};
+static const char* IMPLICIT_INTEGRATOR_NAMES[] = {"semi-implicit", "optimization"};
+
+//Headless driver: runs a scene for a fixed number of steps or simulated
+//seconds and reports simulation throughput; no window or OpenGL required
+int main(int argc, char** argv){
+	const char* scene_file = NULL;
+	int max_steps = 0, threads = NUM_THREADS, sort_interval = SORT_INTERVAL;
+	WeightMode weight_mode = WEIGHT_MODE;
+	TransferMode transfer_mode = TRANSFER_MODE;
+	SortMode sort_mode = SORT_MODE;
+	SimdLevel simd_level = SIMD_LEVEL;
+#if ENABLE_IMPLICIT
+	ImplicitSolver implicit_solver = IMPLICIT_SOLVER;
+	ImplicitPreconditioner implicit_preconditioner = IMPLICIT_PRECONDITIONER;
+	ImplicitIntegrator implicit_integrator = IMPLICIT_INTEGRATOR;
+#endif
+	float max_time = 0;
+	for (int i=1; i<argc; i++){
+		if (!strcmp(argv[i], "-steps") && i+1 < argc)
+			max_steps = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-seconds") && i+1 < argc)
+			max_time = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-threads") && i+1 < argc)
+			threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-weights") && i+1 < argc){
+			if (!parse_weight_mode(argv[++i], weight_mode)){
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!strcmp(argv[i], "-transfer") && i+1 < argc){
+			if (!parse_transfer_mode(argv[++i], transfer_mode)){
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!strcmp(argv[i], "-sort") && i+1 < argc){
+			if (!parse_sort_mode(argv[++i], sort_mode)){
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!strcmp(argv[i], "-simd") && i+1 < argc){
+			if (!parse_simd_level(argv[++i], simd_level)){
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+#if ENABLE_IMPLICIT
+		else if (!strcmp(argv[i], "-solver") && i+1 < argc){
+			if (!parse_implicit_solver(argv[++i], implicit_solver)){
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!strcmp(argv[i], "-precond") && i+1 < argc){
+			if (!parse_implicit_preconditioner(argv[++i], implicit_preconditioner)){
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!strcmp(argv[i], "-integrator") && i+1 < argc){
+			if (!parse_implicit_integrator(argv[++i], implicit_integrator)){
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+#else
+		else if (!strcmp(argv[i], "-solver") || !strcmp(argv[i], "-precond") || !strcmp(argv[i], "-integrator")){
+			fprintf(stderr, "%s needs a build with ENABLE_IMPLICIT\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+#endif
+		else if (!strcmp(argv[i], "-sort-every") && i+1 < argc)
+			sort_interval = atoi(argv[++i]);
+		else if (argv[i][0] != '-' && scene_file == NULL)
+			scene_file = argv[i];
+		else{
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (scene_file == NULL){
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	//Default to a fixed number of steps
+	if (max_steps <= 0 && max_time <= 0)
+		max_steps = 1000;
+	
+	Scene scene;
+	if (!load_scene(scene_file, scene))
+		return EXIT_FAILURE;
+	
+	//Opened before the thread pool, so the pool's threads are counted as well
+	int cache_counter = open_cache_counter();
+	ThreadPool::setSharedThreads(threads);
+	//Computational grid
+	Grid* grid = new Grid(scene.grid_origin, scene.grid_size, scene.grid_cells, scene.snow);
+	grid->weight_mode = weight_mode;
+	grid->transfer_mode = transfer_mode;
+	grid->sort_mode = sort_mode;
+	grid->sort_interval = sort_interval;
+	grid->simd_level = simd_level;
+#if ENABLE_IMPLICIT
+	grid->implicit_solver = implicit_solver;
+	grid->implicit_preconditioner = implicit_preconditioner;
+	grid->implicit_integrator = implicit_integrator;
+#endif
+	//We need to estimate particle volumes before we start
+	grid->initializeMass();
+	grid->calculateVolumes();
+	
+	printf("Scene %s: %d particles, %dx%d grid nodes\n", scene_file, scene.snow->size, (int) grid->size[0], (int) grid->size[1]);
+	printf("Threads: %d\n", ThreadPool::shared()->size());
+	printf("Weight mode: %s, transfer mode: %s\n", weight_mode_name(weight_mode), transfer_mode_name(transfer_mode));
+	if (sort_mode == SORT_NONE || sort_interval <= 0)
+		printf("Particle sorting: off\n");
+	else printf("Particle sorting: %s, every %d steps\n", sort_mode_name(sort_mode), sort_interval);
+	//The grid picks the scalar loops for kernels other than the cubic B-spline
+	const SimdKernels* simd = PARTICLE_STENCIL == SIMD_STENCIL ? simdKernels(simd_level) : NULL;
+	printf("Stencil kernels: %s (CPU supports %s)\n", simd_level_name(simd ? simd->level : SIMD_NONE), simd_level_name(simdSupported()));
+	int particle_bytes = scene.snow->particleBytes();
+	printf("Particle storage: %.2f MB (%d bytes/particle)\n", scene.snow->size*(double) particle_bytes/(1<<20), particle_bytes);
+	Vector2f gravity = Vector2f(0, GRAVITY);
+	SimProfile profile;
+	int steps = 0;
+	float sim_time = 0;
+	float start_locality = particle_locality(grid);
+	long long start_misses = read_cache_counter(cache_counter);
+	double start = SimProfile::now();
+	while ((max_steps > 0 && steps < max_steps) || (max_time > 0 && sim_time < max_time)){
+		sim_time += simulation_step(grid, scene.snow, gravity, &profile);
+		steps++;
+	}
+	double wall_time = SimProfile::now()-start;
+	//Worker threads only add their counts to the total when they exit
+	ThreadPool::setSharedThreads(1);
+	long long cache_misses = cache_counter < 0 ? -1 : read_cache_counter(cache_counter)-start_misses;
+	
+	print_report(scene, grid, profile, steps, sim_time, wall_time, start_locality, cache_misses);
+	if (cache_counter >= 0)
+		close(cache_counter);
+	
+	delete grid;
+	delete scene.snow;
+	return EXIT_SUCCESS;
+}
+
+void print_usage(const char* name){
+	fprintf(stderr,
+		"Usage: %s scene_file [-steps N] [-seconds T] [-threads N]\n"
+		"       [-weights MODE] [-transfer MODE] [-sort MODE] [-sort-every N] [-simd SET]\n"
+		"       [-solver NAME] [-integrator NAME]\n"
+		"  -steps N        run N simulation steps (default 1000)\n"
+		"  -seconds T      run until T seconds have been simulated\n"
+		"  -threads N      number of simulation threads (default %d; 0 = one per core)\n"
+		"  -weights MODE   how interpolation weights are stored: cached, separable\n"
+		"                  or recompute (default %s)\n"
+		"  -transfer MODE  particle/grid transfers: flip or mls (default %s)\n"
+		"  -sort MODE      particle reordering: none, full or incremental (default %s)\n"
+		"  -sort-every N   steps between particle sorts (default %d)\n"
+		"  -simd SET       instruction set for the stencil and plasticity loops: none,\n"
+		"                  sse, avx2, avx512 or auto (default %s)\n"
+		"  -solver NAME    implicit solve, in builds with ENABLE_IMPLICIT: matrix-free,\n"
+		"                  or an assembled cg or bicgstab (default %s)\n"
+		"  -integrator NAME implicit update, in builds with ENABLE_IMPLICIT: semi-implicit\n"
+		"                  or optimization (default %s)\n"
+		"\n"
+		"Scene files contain one command per line ('#' starts a comment):\n"
+		"  grid x y width height cells_x cells_y   computational grid (default 0 0 1 1 64 64)\n"
+		"  snow vx vy                              start a new snow object with initial velocity\n"
+		"  circle x y radius                       add a circle to the current snow object\n"
+		"  polygon x1 y1 x2 y2 x3 y3 ...           add a polygon to the current snow object\n",
+		name, NUM_THREADS, weight_mode_name(WEIGHT_MODE), transfer_mode_name(TRANSFER_MODE),
+		sort_mode_name(SORT_MODE), SORT_INTERVAL, simd_level_name(SIMD_LEVEL),
+		implicit_solver_name(IMPLICIT_SOLVER),
+		implicit_integrator_name(IMPLICIT_INTEGRATOR)
+	);
+}
+
+bool parse_weight_mode(const char* name, WeightMode& mode){
+	for (int i=WEIGHTS_CACHED; i<=WEIGHTS_RECOMPUTE; i++){
+		if (!strcmp(name, WEIGHT_MODE_NAMES[i])){
+			mode = (WeightMode) i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Unknown weight mode \"%s\"\n", name);
+	return false;
+}
+const char* weight_mode_name(WeightMode mode){
+	return WEIGHT_MODE_NAMES[mode];
+}
+bool parse_transfer_mode(const char* name, TransferMode& mode){
+	for (int i=TRANSFER_FLIP; i<=TRANSFER_MLS; i++){
+		if (!strcmp(name, TRANSFER_MODE_NAMES[i])){
+			mode = (TransferMode) i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Unknown transfer mode \"%s\"\n", name);
+	return false;
+}
+const char* transfer_mode_name(TransferMode mode){
+	return TRANSFER_MODE_NAMES[mode];
+}
+bool parse_sort_mode(const char* name, SortMode& mode){
+	for (int i=SORT_NONE; i<=SORT_INCREMENTAL; i++){
+		if (!strcmp(name, SORT_MODE_NAMES[i])){
+			mode = (SortMode) i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Unknown sort mode \"%s\"\n", name);
+	return false;
+}
+const char* sort_mode_name(SortMode mode){
+	return SORT_MODE_NAMES[mode];
+}
+bool parse_simd_level(const char* name, SimdLevel& level){
+	for (int i=SIMD_NONE; i<=SIMD_AUTO; i++){
+		if (!strcmp(name, SIMD_LEVEL_NAMES[i])){
+			level = (SimdLevel) i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Unknown instruction set \"%s\"\n", name);
+	return false;
+}
+const char* simd_level_name(SimdLevel level){
+	return SIMD_LEVEL_NAMES[level];
+}
+bool parse_implicit_solver(const char* name, ImplicitSolver& solver){
+	for (int i=SOLVER_MATRIX_FREE; i<=SOLVER_CHOLESKY; i++){
+		if (!strcmp(name, IMPLICIT_SOLVER_NAMES[i])){
+			solver = (ImplicitSolver) i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Unknown implicit solver \"%s\"\n", name);
+	return false;
+}
+const char* implicit_solver_name(ImplicitSolver solver){
+	return IMPLICIT_SOLVER_NAMES[solver];
+}
+bool parse_implicit_preconditioner(const char* name, ImplicitPreconditioner& preconditioner){
+	for (int i=PRECONDITIONER_DIAGONAL; i<=PRECONDITIONER_ILUT; i++){
+		if (!strcmp(name, IMPLICIT_PRECONDITIONER_NAMES[i])){
+			preconditioner = (ImplicitPreconditioner) i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Unknown preconditioner \"%s\"\n", name);
+	return false;
+}
+const char* implicit_preconditioner_name(ImplicitPreconditioner preconditioner){
+	return IMPLICIT_PRECONDITIONER_NAMES[preconditioner];
+}
+bool parse_implicit_integrator(const char* name, ImplicitIntegrator& integrator){
+	for (int i=INTEGRATOR_SEMI_IMPLICIT; i<=INTEGRATOR_OPTIMIZATION; i++){
+		if (!strcmp(name, IMPLICIT_INTEGRATOR_NAMES[i])){
+			integrator = (ImplicitIntegrator) i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Unknown implicit integrator \"%s\"\n", name);
+	return false;
+}
+const char* implicit_integrator_name(ImplicitIntegrator integrator){
+	return IMPLICIT_INTEGRATOR_NAMES[integrator];
+}
+
+float particle_locality(const Grid* grid){
+	const PointCloud* snow = grid->obj;
+	if (snow->size < 2)
+		return 100;
+	int neighbors = 0, last_x = 0, last_y = 0;
+	for (int i=0; i<snow->size; i++){
+		Vector2f cell = (snow->position[i] - grid->origin)/grid->cellsize;
+		int x = cell[0], y = cell[1];
+		if (i > 0 && abs(x-last_x) <= 1 && abs(y-last_y) <= 1)
+			neighbors++;
+		last_x = x;
+		last_y = y;
+	}
+	return neighbors*100.0/(snow->size-1);
+}
+int open_cache_counter(){
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	//Last level cache misses, i.e. trips to main memory
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+long long read_cache_counter(int fd){
+	long long count;
+	if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+		return -1;
+	return count;
+}
+
+bool load_scene(const char* fname, Scene& scene){
+	ifstream file(fname);
+	if (!file.is_open()){
+		fprintf(stderr, "Could not open scene file %s\n", fname);
+		return false;
+	}
+	scene.grid_origin.setData(0);
+	scene.grid_size.setData(WIN_METERS);
+	scene.grid_cells.setData(64);
+	scene.snow = NULL;
+	
+	//Shapes belonging to the current snow object
+	vector<Shape*> shapes;
+	Vector2f velocity;
+	bool ok = true;
+	string line;
+	for (int line_num=1; ok && getline(file, line); line_num++){
+		size_t comment = line.find('#');
+		if (comment != string::npos)
+			line.erase(comment);
+		istringstream in(line);
+		string cmd;
+		if (!(in >> cmd))
+			continue;
+		
+		if (cmd == "grid"){
+			float x, y, w, h, cx, cy;
+			if (!(in >> x >> y >> w >> h >> cx >> cy) || w <= 0 || h <= 0 || cx < 1 || cy < 1)
+				ok = false;
+			else{
+				scene.grid_origin.setData(x, y);
+				scene.grid_size.setData(w, h);
+				scene.grid_cells.setData((int) cx, (int) cy);
+			}
+		}
+		else if (cmd == "snow"){
+			//Finish the previous snow object
+			ok = add_snow(scene, shapes, velocity);
+			float vx, vy;
+			if (!(in >> vx >> vy))
+				ok = false;
+			else velocity.setData(vx, vy);
+		}
+		else if (cmd == "circle"){
+			float x, y, r;
+			if (!(in >> x >> y >> r) || r <= 0)
+				ok = false;
+			else shapes.push_back(generateSnowball(Vector2f(x, y), r));
+		}
+		else if (cmd == "polygon"){
+			//Read all the coordinates first, so a trailing x without a y is caught
+			vector<float> coords;
+			float c;
+			while (in >> c)
+				coords.push_back(c);
+			if (!in.eof() || coords.size() % 2 || coords.size() < 6)
+				ok = false;
+			else{
+				Shape* poly = new Shape();
+				for (int i=0, len=coords.size(); i<len; i+=2)
+					poly->addPoint(coords[i], coords[i+1]);
+				shapes.push_back(poly);
+			}
+		}
+		else ok = false;
+		
+		if (!ok)
+			fprintf(stderr, "%s:%d: invalid command \"%s\"\n", fname, line_num, line.c_str());
+	}
+	//Finish the last snow object
+	if (ok)
+		ok = add_snow(scene, shapes, velocity);
+	for (int i=0, len=shapes.size(); i<len; i++)
+		delete shapes[i];
+	if (!ok)
+		return false;
+	
+	if (scene.snow == NULL){
+		fprintf(stderr, "%s: scene does not contain any snow\n", fname);
+		return false;
+	}
+	//Particles must stay away from the grid borders, or the transfers will index outside the grid
+	float bounds[4];
+	Vector2f cellsize = scene.grid_size/scene.grid_cells,
+		lo = scene.grid_origin + cellsize*GridKernel::radius(),
+		hi = scene.grid_origin + scene.grid_size - cellsize*GridKernel::radius();
+	scene.snow->bounds(bounds);
+	if (bounds[0] < lo[0] || bounds[1] > hi[0] || bounds[2] < lo[1] || bounds[3] > hi[1]){
+		fprintf(stderr, "%s: snow must be at least %g cells inside the grid\n", fname, GridKernel::radius());
+		delete scene.snow;
+		scene.snow = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool add_snow(Scene& scene, vector<Shape*>& shapes, const Vector2f& velocity){
+	if (shapes.empty())
+		return true;
+	PointCloud* obj = PointCloud::createShape(shapes, velocity);
+	for (int i=0, len=shapes.size(); i<len; i++)
+		delete shapes[i];
+	shapes.clear();
+	//Shapes had no area
+	if (obj == NULL)
+		return true;
+	
+	if (scene.snow == NULL)
+		scene.snow = obj;
+	else{
+		scene.snow->merge(*obj);
+		delete obj;
+	}
+	return true;
+}
+
+void print_report(const Scene& scene, const Grid* grid, const SimProfile& profile, int steps, float sim_time, double wall_time,
+	float start_locality, long long cache_misses){
+	int particles = scene.snow->size;
+	printf("Simulated %.4f s in %d steps (%.3f s wall time)\n", sim_time, steps, wall_time);
+	printf("  steps/sec:            %.2f\n", steps/wall_time);
+	printf("  particle-steps/sec:   %.4g\n", particles*(double) steps/wall_time);
+	printf("  sim seconds/hour:     %.4g\n", sim_time/wall_time*3600);
+	printf("Phase              total (s)   per step (ms)   percent\n");
+	for (int i=0; i<NUM_PHASES; i++){
+		double t = profile.phase_time[i];
+		printf("  %-16s %9.3f   %13.4f   %6.2f%%\n",
+			SimProfile::phaseName((SimPhase) i), t, t/steps*1000, t/wall_time*100
+		);
+	}
+	printf("Particle locality: %.1f%% at start, %.1f%% at end\n", start_locality, particle_locality(grid));
+	if (cache_misses >= 0)
+		printf("Cache misses: %.4g (%.2f per particle-step)\n", (double) cache_misses, cache_misses/((double) particles*steps));
+	else printf("Cache misses: no hardware counters available\n");
+#if ENABLE_IMPLICIT
+	if (grid->implicit_solver == SOLVER_MATRIX_FREE)
+		printf("Implicit solve: %.1f iterations per step (matrix-free)\n", grid->implicit_iterations/(double) steps);
+	else if (grid->implicit_solver == SOLVER_CHOLESKY)
+		printf("Implicit solve: assembled, direct (cholesky)\n");
+	else printf("Implicit solve: %.1f iterations per step (assembled %s, %s)\n", grid->implicit_iterations/(double) steps,
+		implicit_solver_name(grid->implicit_solver), implicit_preconditioner_name(grid->implicit_preconditioner));
+	if (grid->implicit_integrator == INTEGRATOR_OPTIMIZATION)
+		printf("Optimization integrator: %.1f Newton iterations per step\n", grid->newton_iterations/(double) steps);
+#endif
+}
@@ -0,0 +1,61 @@
+#ifndef BATCH_H
+#define	BATCH_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "PointCloud.h"
+#include "Grid.h"
+#include "SimConstants.h"
+#include "Shape.h"
+#include "Simulation.h"
+#include "ThreadPool.h"
+
+//Scene to simulate, as read from a scene file
+struct Scene{
+	//Computational grid
+	Vector2f grid_origin, grid_size, grid_cells;
+	//All snow objects, merged into one point cloud
+	PointCloud* snow;
+};
+
+//Loads a scene file; returns false on error
+bool load_scene(const char* fname, Scene& scene);
+//Converts a group of shapes to particles and adds them to the scene
+bool add_snow(Scene& scene, std::vector<Shape*>& shapes, const Vector2f& velocity);
+//Weight mode names, as given on the command line; returns false if name is unknown
+bool parse_weight_mode(const char* name, WeightMode& mode);
+const char* weight_mode_name(WeightMode mode);
+bool parse_transfer_mode(const char* name, TransferMode& mode);
+const char* transfer_mode_name(TransferMode mode);
+bool parse_sort_mode(const char* name, SortMode& mode);
+const char* sort_mode_name(SortMode mode);
+bool parse_simd_level(const char* name, SimdLevel& level);
+const char* simd_level_name(SimdLevel level);
+bool parse_implicit_solver(const char* name, ImplicitSolver& solver);
+const char* implicit_solver_name(ImplicitSolver solver);
+bool parse_implicit_preconditioner(const char* name, ImplicitPreconditioner& preconditioner);
+const char* implicit_preconditioner_name(ImplicitPreconditioner preconditioner);
+bool parse_implicit_integrator(const char* name, ImplicitIntegrator& integrator);
+const char* implicit_integrator_name(ImplicitIntegrator integrator);
+//Percentage of particles whose grid cell is next to the previous particle's; when
+//this is high, consecutive particles mostly share the same grid nodes
+float particle_locality(const Grid* grid);
+//Hardware cache miss counter for this process, including threads created after it is
+//opened; returns -1 if the system doesn't support it (e.g. virtual machines)
+int open_cache_counter();
+long long read_cache_counter(int fd);
+void print_usage(const char* name);
+void print_report(const Scene& scene, const Grid* grid, const SimProfile& profile, int steps, float sim_time, double wall_time,
+	float start_locality, long long cache_misses);
+
+#endif
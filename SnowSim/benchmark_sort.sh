@@ -0,0 +1,45 @@
+#!/bin/bash
+#Compares the particle sort modes (see SortMode in Grid.h) on scenes with
+#different particle counts; prints the best of several runs for each, along
+#with the hardware cache misses per particle-step, if they can be counted
+#Usage: ./benchmark_sort.sh [runs] [threads] [sort interval]
+cd "$(dirname "$0")"
+RUNS=${1:-3}
+THREADS=${2:-0}
+INTERVAL=${3:-10}
+BATCH=dist/Batch/snowsim-batch
+MODES="none full incremental"
+
+make snowsim-batch > /dev/null || exit 1
+
+#scene file and number of steps to run it for
+run_scene(){
+	scene=$1
+	steps=$2
+	printf "%-12s" $(basename $scene .scene)
+	for mode in $MODES; do
+		best=0
+		misses="-"
+		for ((r=0; r<RUNS; r++)); do
+			out=$($BATCH $scene -steps $steps -threads $THREADS -sort $mode -sort-every $INTERVAL)
+			rate=$(echo "$out" | sed -n 's/.*particle-steps\/sec: *//p')
+			if [ $(echo "$rate $best" | awk '{print ($1 > $2)}') = 1 ]; then
+				best=$rate
+				misses=$(echo "$out" | sed -n 's/.*(\([0-9.]*\) per particle-step.*/\1/p')
+			fi
+		done
+		printf " %12.4g %8s" $best ${misses:--}
+	done
+	echo
+}
+
+echo "Particle-steps/sec and cache misses per particle-step for each sort mode (best of $RUNS runs)"
+printf "%-12s" scene
+for mode in $MODES; do
+	printf " %12s %8s" $mode misses
+done
+echo
+run_scene scenes/snowball.scene 2000
+run_scene scenes/medium.scene 200
+run_scene scenes/benchmark.scene 40
+run_scene scenes/large.scene 10
@@ -0,0 +1,39 @@
+#!/bin/bash
+#Compares the grid weight modes (see WeightMode in Grid.h) on scenes with
+#different particle counts; prints the best of several runs for each, since
+#a single short run is easily thrown off by other processes
+#Usage: ./benchmark_weights.sh [runs] [threads]
+cd "$(dirname "$0")"
+RUNS=${1:-3}
+THREADS=${2:-0}
+BATCH=dist/Batch/snowsim-batch
+MODES="cached separable recompute"
+
+make snowsim-batch > /dev/null || exit 1
+
+#scene file and number of steps to run it for
+run_scene(){
+	scene=$1
+	steps=$2
+	particles=$($BATCH $scene -steps 1 -threads $THREADS | sed -n 's/.*: \([0-9]*\) particles.*/\1/p')
+	printf "%-24s %9d" $(basename $scene .scene) $particles
+	for mode in $MODES; do
+		best=0
+		for ((r=0; r<RUNS; r++)); do
+			rate=$($BATCH $scene -steps $steps -threads $THREADS -weights $mode | sed -n 's/.*particle-steps\/sec: *//p')
+			best=$(echo "$rate $best" | awk '{print ($1 > $2) ? $1 : $2}')
+		done
+		printf " %12.4g" $best
+	done
+	echo
+}
+
+echo "Particle-steps/sec for each weight mode (best of $RUNS runs)"
+printf "%-24s %9s" scene particles
+for mode in $MODES; do
+	printf " %12s" $mode
+done
+echo
+run_scene scenes/snowball.scene 2000
+run_scene scenes/medium.scene 200
+run_scene scenes/benchmark.scene 40
@@ -281,22 +281,7 @@ void *simulate(void *args){
 	float cum_sum = 0;
 	int iter = 0;
 	while (simulating && ++iter > 0){
-		TIMESTEP = adaptive_timestep();
-		cum_sum += TIMESTEP;
-		
-		//Initialize FEM grid
-		grid->initializeMass();
-		grid->initializeVelocities();
-		//Compute grid velocities
-		grid->explicitVelocities(gravity);
-#if ENABLE_IMPLICIT
-		if (IMPLICIT_RATIO > 0)
-			grid->implicitVelocities();
-#endif
-		//Map back to particles
-		grid->updateVelocities();
-		//Update particle data
-		snow->update();
+		cum_sum += simulation_step(grid, snow, gravity, NULL);
 		
 		//Redraw snow
 		if (!LIMIT_FPS || cum_sum >= FRAMERATE){
@@ -322,17 +307,6 @@ void *simulate(void *args){
 	simulating = false;
 	pthread_exit(NULL);
 }
-float adaptive_timestep(){
-	float max_vel = snow->max_velocity, f;
-	if (max_vel > 1e-8){
-		//We should really take the min(cellsize) I think, if the grid is not square
-		float dt = CFL * grid->cellsize[0]/sqrt(max_vel);
-		f = dt > FRAMERATE ? FRAMERATE : dt;
-	}
-	else f = FRAMERATE;
-	return f > MAX_TIMESTEP ? MAX_TIMESTEP : f;
-}
-
 void redraw(){
 	glClearColor(0, 0, 0, 1);
 	glClear(GL_COLOR_BUFFER_BIT);
@@ -356,13 +330,12 @@ void redraw(){
 		glPointSize(point_size);
 		glBegin(GL_POINTS);
 		for (int i=0; i<snow->size; i++){
-			Particle& p = snow->particles[i];
 			//We can use the particle's density to vary color
 			float contrast = 0.6;
-			float density = p.density/DENSITY*contrast;
+			float density = snow->density[i]/DENSITY*contrast;
 			density += 1-contrast;
 			glColor3f(density, density, density);
-			glVertex2fv(p.position.data);
+			glVertex2fv(snow->position[i].data);
 		}
 		glEnd();
 		if (SUPPORTS_POINT_SMOOTH)
@@ -400,23 +373,3 @@ void save_buffer(int time){
 	FreeImage_Unload(img);
 }
 #endif
-
-Shape* generateSnowball(Vector2f origin, float radius){
-	Shape* snowball = new Shape();
-	const int segments = 18;
-	//Cool circle algorithm: http://slabode.exofire.net/circle_draw.shtml
-	float theta = 6.283185307 / (float) segments,
-		tan_fac = tan(theta),
-		cos_fac = cos(theta),
-		x = radius,
-		y = 0;
-	for (int i=0; i<segments; i++){
-		snowball->addPoint(x+origin[0], y+origin[1]);
-		float flip_x = -y, flip_y = x;
-		x += flip_x*tan_fac;
-		y += flip_y*tan_fac;
-		x *= cos_fac;
-		y *= cos_fac;
-	}
-	return snowball;
-}
\ No newline at end of file
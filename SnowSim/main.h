@@ -11,13 +11,11 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <math.h>
-#include "Particle.h"
 #include "PointCloud.h"
 #include "Grid.h"
 #include "SimConstants.h"
 #include "Shape.h"
-
-float TIMESTEP;
+#include "Simulation.h"
 
 static void error_callback(int, const char*);
 void key_callback(GLFWwindow*, int, int, int, int);
@@ -25,13 +23,11 @@ void mouse_callback(GLFWwindow*, int, int, int);
 void redraw();
 void start_simulation();
 void *simulate(void *args);
-float adaptive_timestep();
 void save_buffer(int time);
 
 //Shape stuff
 void create_new_shape();
 void remove_all_shapes();
-Shape* generateSnowball(Vector2f origin, float radius);
 
 #endif
 
@@ -37,9 +37,11 @@ OBJECTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}
 OBJECTFILES= \
 	${OBJECTDIR}/Grid.o \
 	${OBJECTDIR}/Matrix2f.o \
-	${OBJECTDIR}/Particle.o \
 	${OBJECTDIR}/PointCloud.o \
 	${OBJECTDIR}/Shape.o \
+	${OBJECTDIR}/Simulation.o \
+	${OBJECTDIR}/StencilSimd.o \
+	${OBJECTDIR}/ThreadPool.o \
 	${OBJECTDIR}/Vector2f.o \
 	${OBJECTDIR}/main.o
 
@@ -78,11 +80,6 @@ ${OBJECTDIR}/Matrix2f.o: Matrix2f.cpp
 	${RM} "$@.d"
 	$(COMPILE.cc) -g -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Matrix2f.o Matrix2f.cpp
 
-${OBJECTDIR}/Particle.o: Particle.cpp 
-	${MKDIR} -p ${OBJECTDIR}
-	${RM} "$@.d"
-	$(COMPILE.cc) -g -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Particle.o Particle.cpp
-
 ${OBJECTDIR}/PointCloud.o: PointCloud.cpp 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"
@@ -93,6 +90,21 @@ ${OBJECTDIR}/Shape.o: Shape.cpp
 	${RM} "$@.d"
 	$(COMPILE.cc) -g -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Shape.o Shape.cpp
 
+${OBJECTDIR}/Simulation.o: Simulation.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/Simulation.o Simulation.cpp
+
+${OBJECTDIR}/StencilSimd.o: StencilSimd.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/StencilSimd.o StencilSimd.cpp
+
+${OBJECTDIR}/ThreadPool.o: ThreadPool.cpp 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/ThreadPool.o ThreadPool.cpp
+
 ${OBJECTDIR}/Vector2f.o: Vector2f.cpp 
 	${MKDIR} -p ${OBJECTDIR}
 	${RM} "$@.d"